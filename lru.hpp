@@ -10,8 +10,24 @@
  *
  */
 
-#include <hashtable.h>
+#ifndef PLB_LRU_HPP
+#define PLB_LRU_HPP
+
+#include <hash_fun.h>
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <new>
 #include <sstream>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 #include <cassert>
 
 namespace {
@@ -26,14 +42,23 @@ struct LRUCacheH4Value
 	typedef std::pair<const K, LRUCacheH4Value<K, V> > Val;
 	
 	LRUCacheH4Value()
-		: _v(), _older(NULL), _newer(NULL) { }
+		: _v(), _weight(0), _expires(0), _scheduled(0), _older(NULL), _newer(NULL), _next(NULL) { }
 	
 	LRUCacheH4Value(const V & v, Val * older, Val * newer)
-		: _v(v), _older(older), _newer(newer) { } 
+		: _v(v), _weight(0), _expires(0), _scheduled(0), _older(older), _newer(newer), _next(NULL) { } 
+	
+	// constructs the value from args, in place
+	template<class... Args>
+	LRUCacheH4Value(std::in_place_t, Args &&... args)
+		: _v(std::forward<Args>(args)...), _weight(0), _expires(0), _scheduled(0), _older(NULL), _newer(NULL), _next(NULL) { }
 	
 	V _v;
+	unsigned long _weight; // as charged to the cache when the entry was last set
+	uint32_t _expires;     // clock tick, 0 if the entry never expires
+	uint32_t _scheduled;   // tick of the timer pending for the entry, 0 if none
 	Val * _older;
 	Val * _newer;
+	Val * _next;    // next entry in the same index bucket
 };
 
 
@@ -127,6 +152,121 @@ const V & LRUCacheH4ConstIterator<K, V>::value() const
 	assert(_ptr); 
 	return _ptr->second._v;
 }
+
+//-------------------------------------------------------------
+// Timer Wheel
+//-------------------------------------------------------------
+
+// Milliseconds on a monotonic clock, wrapping every 49 days
+inline uint32_t lru_cache_h4_clock()
+{
+	return uint32_t(std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+
+// Hierarchical timer wheel over 32-bit ticks: 4 levels of 256 slots, level
+// l holding the timers that differ from the current time in byte l at most.
+// A slot of level l > 0 is cascaded into the lower levels when the time
+// reaches its boundary. Timers are (key, expiry) pairs and are never
+// cancelled: as a slot cascades, keep(key, expiry) tells which are still
+// wanted and the others are dropped; the cache ignores those that fire
+// stale.
+template<class K>
+class LRUCacheH4TimerWheel
+{
+public:
+	typedef std::pair<K, uint32_t> Timer;
+	
+	LRUCacheH4TimerWheel(uint32_t now)
+		: _time(now)
+	{
+		for (int l = 0;  l < LEVELS;  ++l)
+			_counts[l] = 0;
+	}
+	
+	// Pre-condition: expires is less than 2^31 ticks away
+	void schedule(const K & key, uint32_t expires)
+	{
+		if (int32_t(expires - _time) <= 0) {
+			_due.push_back(Timer(key, expires));
+			return;
+		}
+		
+		uint32_t diff = expires ^ _time;
+		int l = diff < 0x100 ? 0 : diff < 0x10000 ? 1 : diff < 0x1000000 ? 2 : 3;
+		_slots[l][(expires >> (8 * l)) & 0xFF].push_back(Timer(key, expires));
+		++_counts[l];
+	}
+	
+	// Appends the timers that expire at or before now to due. Stretches of
+	// time where the lower levels are empty are skipped one boundary at a
+	// time, so catching up after a long idle period stays cheap.
+	template<class Keep>
+	void advance(uint32_t now, std::vector<Timer> & due, Keep keep)
+	{
+		due.insert(due.end(), _due.begin(), _due.end());
+		_due.clear();
+		
+		while (int32_t(now - _time) > 0) {
+			int empty = 0;
+			while (empty < LEVELS && _counts[empty] == 0)
+				++empty;
+			if (empty == LEVELS) {
+				_time = now;
+				break;
+			}
+			
+			uint32_t step = empty == 0 ? 1 : 1u << (8 * empty);
+			uint32_t next = (_time & ~(step - 1)) + step;
+			if (int32_t(now - next) < 0) {
+				_time = now;
+				break;
+			}
+			
+			// cascading may find timers due right now
+			_time = next;
+			for (int l = LEVELS - 1;  l > 0;  --l)
+				if ((_time & ((1u << (8 * l)) - 1)) == 0)
+					_cascade(l, keep);
+			due.insert(due.end(), _due.begin(), _due.end());
+			_due.clear();
+			_fire(_slots[0][_time & 0xFF], due);
+		}
+	}
+	
+	uint32_t time() const
+	{
+		return _time;
+	}
+
+private:
+	enum { LEVELS = 4, SLOTS = 256 };
+	
+	template<class Keep>
+	void _cascade(int l, Keep keep)
+	{
+		std::vector<Timer> timers;
+		timers.swap(_slots[l][(_time >> (8 * l)) & 0xFF]);
+		_counts[l] -= timers.size();
+		for (size_t i = 0;  i < timers.size();  ++i)
+			if (keep(timers[i].first, timers[i].second))
+				schedule(timers[i].first, timers[i].second);
+	}
+	
+	void _fire(std::vector<Timer> & slot, std::vector<Timer> & due)
+	{
+		due.insert(due.end(), slot.begin(), slot.end());
+		_counts[0] -= slot.size();
+		slot.clear();
+	}
+
+private:
+	std::vector<Timer> _slots[LEVELS][SLOTS];
+	size_t _counts[LEVELS];
+	std::vector<Timer> _due;
+	uint32_t _time;
+};
 	
 	
 } // file scope
@@ -135,185 +275,1064 @@ const V & LRUCacheH4ConstIterator<K, V>::value() const
 namespace plb {
 
 //-------------------------------------------------------------
-// LRU Cache
+// Weight functors
+//-------------------------------------------------------------
+
+// Default weight: the capacity is a number of entries
+template<class V>
+struct LRUCacheH4Count
+{
+	unsigned long operator()(const V &) const { return 1; }
+};
+
+
+//-------------------------------------------------------------
+// Hash and equality functors
+//-------------------------------------------------------------
+
+// Default hash: __gnu_cxx::hash, except for std::string which is hashed as
+// a std::string_view. Being transparent, it also hashes string views and
+// C strings, so string keys can be looked up without building a string.
+template<class K>
+struct LRUCacheH4Hash : public __gnu_cxx::hash<K>
+{
+};
+
+template<>
+struct LRUCacheH4Hash<std::string>
+{
+	typedef void is_transparent;
+	
+	size_t operator()(std::string_view s) const { return std::hash<std::string_view>()(s); }
+};
+
+
+template<class K>
+struct LRUCacheH4Equal : public std::equal_to<K>
+{
+};
+
+template<>
+struct LRUCacheH4Equal<std::string> : public std::equal_to<void>
+{
+};
+
+
+// LRUCacheH4Lookup<H, E, Q, R>::type is R if H and E are transparent, and
+// only then are lookups by a Q that is not a K enabled
+template<class H, class E, class Q, class R, class = void>
+struct LRUCacheH4Lookup
+{
+};
+
+template<class H, class E, class Q, class R>
+struct LRUCacheH4Lookup<H, E, Q, R, std::void_t<typename H::is_transparent, typename E::is_transparent> >
+{
+	typedef R type;
+};
+
+
+//-------------------------------------------------------------
+// Statistics
+//-------------------------------------------------------------
+
+// Counters are only kept if PLB_LRU_STATS is defined: otherwise they cost
+// nothing, and stats() returns zeros. Only the increments are compiled out:
+// the cache has the same layout in every translation unit.
+#ifdef PLB_LRU_STATS
+#define PLB_LRU_COUNT(counter) (++_stats.counter)
+#else
+#define PLB_LRU_COUNT(counter) ((void) 0)
+#endif
+
+
+// A snapshot of the counters of a cache. Only accesses count as hits or
+// misses: find(), operator[] and multi_get(), not contains() or a const find().
+struct LRUCacheH4Stats
+{
+	LRUCacheH4Stats()
+		: _hits(0), _misses(0), _inserts(0), _updates(0), _evictions(0), _erasures(0), _expirations(0) { }
+	
+	LRUCacheH4Stats & operator+=(const LRUCacheH4Stats & other)
+	{
+		_hits += other._hits;
+		_misses += other._misses;
+		_inserts += other._inserts;
+		_updates += other._updates;
+		_evictions += other._evictions;
+		_erasures += other._erasures;
+		_expirations += other._expirations;
+		return *this;
+	}
+	
+	double hit_ratio() const
+	{
+		return _hits + _misses > 0 ? double(_hits) / (_hits + _misses) : 0.0;
+	}
+	
+	unsigned long _hits;
+	unsigned long _misses;
+	unsigned long _inserts;        // new entries
+	unsigned long _updates;        // values replaced
+	unsigned long _evictions;
+	unsigned long _erasures;
+	unsigned long _expirations;
+};
+
+
+inline std::ostream & operator<<(std::ostream & os, const LRUCacheH4Stats & stats)
+{
+	return os << "hits: " << stats._hits << ", misses: " << stats._misses
+	          << ", hit ratio: " << stats.hit_ratio() << ", inserts: " << stats._inserts
+	          << ", updates: " << stats._updates << ", evictions: " << stats._evictions
+	          << ", erasures: " << stats._erasures << ", expirations: " << stats._expirations;
+}
+
+
+//-------------------------------------------------------------
+// Removal listener
 //-------------------------------------------------------------
 
+// Why a value left the cache
+enum LRUCacheH4Removal {
+	LRU_EVICTED = 0,   // to make room, by size or by weight
+	LRU_ERASED,        // by erase()
+	LRU_REPLACED,      // overwritten by a new value for its key
+	LRU_EXPIRED
+};
+
+
+// A removal queued for deferred delivery: the value is moved out of the cache
 template<class K, class V>
+struct LRUCacheH4Removed
+{
+	LRUCacheH4Removed(const K & key, V && v, LRUCacheH4Removal cause)
+		: _key(key), _v(std::move(v)), _cause(cause) { }
+	
+	K _key;
+	V _v;
+	LRUCacheH4Removal _cause;
+};
+
+
+//-------------------------------------------------------------
+// LRU Cache
+//-------------------------------------------------------------
+
+// W returns the weight of a value, e.g. its size in bytes. The cache holds
+// at most maxsize entries and at most maxweight worth of values.
+//
+// Entries may expire: TTLs are in clock ticks (milliseconds by default) and
+// must be less than 2^31 ticks. An expired entry is a miss for find() and
+// operator[]. Expired entries are reclaimed in batches by a timer wheel,
+// before any LRU entry is evicted; until then they still count in size().
+//
+// H and E hash and compare keys. If both are transparent, as they are for
+// std::string keys by default, find(), contains(), erase() and operator[]
+// accept any type they accept, and a K is only built to insert a new entry.
+//
+// A listener may be told of every value that leaves the cache, other than
+// by its destruction: evicted, erased, replaced or expired. It is called
+// before the value is destroyed or overwritten, and must not modify the
+// cache. In deferred mode the removals are queued instead, values moved
+// out, until deliver() or take_removals(): a front-end can then run the
+// listener, and the value destructors, after releasing its lock.
+template<class K, class V, class W = LRUCacheH4Count<V>, class H = LRUCacheH4Hash<K>, class E = LRUCacheH4Equal<K> >
 class LRUCacheH4
 {
 public:
 	typedef LRUCacheH4ConstIterator<K, V> const_iterator;
+	typedef uint32_t (*Clock)();
+	typedef std::function<void (const K & key, V & value, LRUCacheH4Removal cause)> Listener;
+	typedef std::deque<LRUCacheH4Removed<K, V> > Removals;   // queued values never move again
 	
 public:
-	LRUCacheH4(int maxsize);                    // Pre-condition: maxsize >= 1
+	// Pre-condition: maxsize >= 1. maxweight defaults to maxsize.
+	LRUCacheH4(int maxsize, bool pooled = false, unsigned long maxweight = 0);
 	LRUCacheH4(const LRUCacheH4 & other);
+	~LRUCacheH4();
 	
-	V & operator[](const K & key);
-	void insert(const K & key, const V & value);
+	V & operator[](const K & key);              // charges the weight of V()
+	template<class Q> typename LRUCacheH4Lookup<H, E, Q, V &>::type operator[](const Q & key);
+	void insert(const K & key, const V & value);                    // default TTL
+	void insert(const K & key, const V & value, unsigned int ttl);  // 0: never expires
+	
+	// The value is constructed in place, from args or value, and the key is
+	// moved in if given an rvalue: nothing is built or copied twice. The
+	// bool is true if an entry was inserted (or assigned).
+	template<class... Args> std::pair<const_iterator, bool> try_emplace(const K & key, Args &&... args);
+	template<class... Args> std::pair<const_iterator, bool> try_emplace(K && key, Args &&... args);
+	template<class... Args> std::pair<const_iterator, bool> emplace(K && key, Args &&... args);  // same as try_emplace
+	template<class M> std::pair<const_iterator, bool> insert_or_assign(const K & key, M && value);
+	template<class M> std::pair<const_iterator, bool> insert_or_assign(K && key, M && value);
+	
+	void set_default_ttl(unsigned int ttl);     // for new entries, 0 (the default): never
+	unsigned int default_ttl() const;
+	unsigned int ttl(const K & key) const;      // ticks left, 0 if no live entry or no expiry
+	void set_clock(Clock clock);
+	int expire();                               // reclaims expired entries now
+	
+	void set_listener(const Listener & listener, bool deferred = false);  // not copied with the cache
+	int deliver();                              // deferred removals to the listener; returns how many
+	void take_removals(Removals & removals);    // appends the deferred removals to removals
+	
+	// Applied in bounded steps, piggybacked on the following lookups: a
+	// shrink evicts a few LRU entries at a time, a grow moves a few index
+	// buckets at a time to a larger index. maxweight defaults to the current
+	// one if it was given, to maxsize otherwise.
+	void set_maxsize(int maxsize, unsigned long maxweight = 0);
+	bool resizing() const;                      // a set_maxsize() is still being applied
 	
 	int size() const;
 	int maxsize() const;
 	bool empty() const;
+	bool pooled() const;
+	unsigned long weight() const;
+	unsigned long maxweight() const;
 	
 	const_iterator find(const K & key);         // updates the MRU
 	const_iterator find(const K & key) const;   // does not update the MRU
+	template<class Q> typename LRUCacheH4Lookup<H, E, Q, const_iterator>::type find(const Q & key);
+	template<class Q> typename LRUCacheH4Lookup<H, E, Q, const_iterator>::type find(const Q & key) const;
+	
+	// Batches of find() and insert(), with the same result as n calls in
+	// order. Buckets and nodes are prefetched for the whole batch before any
+	// is used, so that their cache misses overlap instead of adding up.
+	int multi_get(const K * keys, int n, const_iterator * found);   // end() on a miss; returns the hits
+	void multi_put(const K * keys, const V * values, int n);
+	
+	bool contains(const K & key) const;         // does not update the MRU
+	template<class Q> typename LRUCacheH4Lookup<H, E, Q, bool>::type contains(const Q & key) const;
+	
+	bool erase(const K & key);                  // false if there was no such entry
+	template<class Q> typename LRUCacheH4Lookup<H, E, Q, bool>::type erase(const Q & key);
+	template<class P> int erase_if(P pred);     // pred(key, value); returns how many were erased
+	void clear();
+	
 	const_iterator mru_begin() const;           // from MRU to LRU
 	const_iterator lru_begin() const;           // from LRU to MRU
 	const_iterator end() const;
 	
 	void dump_mru_to_lru(std::ostream & os) const;
+	
+	LRUCacheH4Stats stats() const;
+	void dump_stats(std::ostream & os) const;
 
 private:
 	typedef std::pair<const K, LRUCacheH4Value<K, V> > Val;
-	typedef __gnu_cxx::hashtable<Val, K, __gnu_cxx::hash<K>, std::_Select1st<Val>, std::equal_to<K> > MAP_TYPE;
+	
+	// keys prefetched at a time: about as many misses as a core keeps in flight
+	enum { PREFETCH_BATCH = 16 };
+	
+	// evictions, and index buckets moved, per step of a resize; buckets of
+	// a new index cleared per step
+	enum { RESIZE_STEP = 64, CLEAR_STEP = 4096 };
+	
+	// every value weighs 1, which maxweight always admits: no need to weigh
+	// a value before making room for it
+	static const bool COUNTED = std::is_same<W, LRUCacheH4Count<V> >::value;
 
 private:
+	LRUCacheH4 & operator=(const LRUCacheH4 & other);
+	
+	template<class Q> V & _subscript(const Q & key);
+	template<class Q> const_iterator _find(const Q & key);
+	template<class Q> const_iterator _find(const Q & key) const;
+	template<class Q> bool _erase_key(const Q & key);
+	
+	template<class KK, class... Args> std::pair<const_iterator, bool> _try_emplace(KK && key, Args &&... args);
+	template<class KK, class M> std::pair<const_iterator, bool> _insert_or_assign(KK && key, M && value);
+	std::pair<const_iterator, bool> _admit(Val * node, unsigned int ttl);
+	
 	Val * _update_or_insert(const K & key);
-	Val * _update(typename MAP_TYPE::iterator it);
-	Val * _insert(const K & key);
+	Val * _update(Val * moved);
+	template<class KK, class... Args> Val * _insert(KK && key, Args &&... args);
+	void _erase(Val * node, LRUCacheH4Removal cause);
+	void _notify(Val * node, LRUCacheH4Removal cause);
+	void _charge(Val * node, unsigned long weight);
+	
+	template<class Q> Val * _lookup_live(const Q & key);
+	bool _expired(const Val * node) const;
+	void _set_ttl(Val * node, unsigned int ttl);
+	void _schedule(Val * node, uint32_t expires);
+	int _expire(uint32_t now);
+	
+	template<class Q> Val ** _bucket(const Q & key) const;
+	template<class Q> Val ** _old_bucket(const Q & key) const;
+	static Val ** _allocate_buckets(int maxsize, int & shift, bool clear);
+	void _prefetch(const K * keys, int n, Val ** buckets[]) const;
+	template<class Q> Val * _lookup(const Q & key) const;
+	void _index(Val * node);
+	void _unindex(Val * node);
+	void _unindex_growing(Val * node);
+	
+	void _resize_step();
+	void _prepare(size_t buckets);
+	void _migrate(size_t buckets);
+	
+	Val * _acquire();
+	void _release(Val * node);
 
 private:
-	MAP_TYPE _map;
+	Val ** _buckets;
+	int _shift;                                 // 64 - log2(number of buckets)
+	int _size;
 	Val * _mru;
 	Val	* _lru;
 	int _maxsize;
+	bool _resizing;                             // index growing, or entries over the maximums
+	unsigned long _weight;
+	unsigned long _maxweight;
+	bool _weighted;                             // _maxweight was given, rather than following _maxsize
+	
+	// pooled mode: maxsize nodes allocated up front in one block; nodes
+	// beyond it, after set_maxsize() grew the cache, come from the heap
+	Val * _pool;
+	int _pool_size;
+	int _pool_used;
+	Val * _free;                                // released pool nodes
+	
+	// expiry: the wheel is only allocated once a TTL is used
+	Clock _clock;
+	unsigned int _default_ttl;
+	LRUCacheH4TimerWheel<K> * _wheel;
+	std::vector<typename LRUCacheH4TimerWheel<K>::Timer> _due;
+	
+	Listener _listener;
+	bool _deferred;
+	Removals _removed;                          // deferred removals
+	
+	// growing the index: the next one is cleared, then takes over while
+	// the old one is moved to it; the old one is still searched on a miss
+	Val ** _next_buckets;
+	int _next_shift;
+	size_t _cleared;                            // buckets of the next index cleared so far
+	Val ** _old_buckets;
+	int _old_shift;
+	size_t _old_size;
+	size_t _migrated;                           // old buckets moved so far
+	
+	// on a line of its own: a sharded front-end keeps shards on separate lines
+	alignas(64) LRUCacheH4Stats _stats;
 };
 
 
-// Reserve enough space to avoid resizing later on and thus invalidate iterators
-template<class K, class V>
-LRUCacheH4<K, V>::LRUCacheH4(int maxsize)
-	: _map(maxsize, __gnu_cxx::hash<K>(), std::equal_to<K>()),
+// The index is sized for maxsize entries: it only grows with set_maxsize(),
+// and never invalidates iterators, which follow the recency list.
+//
+// Once the cache is full, the LRU node is destroyed and the new entry is
+// constructed in its place, so a full cache never allocates. In pooled mode
+// the nodes are also allocated up front, in one block: filling the cache
+// does not allocate either and the nodes are contiguous.
+template<class K, class V, class W, class H, class E>
+LRUCacheH4<K, V, W, H, E>::LRUCacheH4(int maxsize, bool pooled, unsigned long maxweight)
+	: _buckets(NULL),
+	  _shift(63),
+	  _size(0),
 	  _mru(NULL),
 	  _lru(NULL),
-	  _maxsize(maxsize)
+	  _maxsize(maxsize),
+	  _resizing(false),
+	  _weight(0),
+	  _maxweight(maxweight ? maxweight : maxsize),
+	  _weighted(maxweight != 0),
+	  _pool(NULL),
+	  _pool_size(0),
+	  _pool_used(0),
+	  _free(NULL),
+	  _clock(lru_cache_h4_clock),
+	  _default_ttl(0),
+	  _wheel(NULL),
+	  _deferred(false),
+	  _next_buckets(NULL),
+	  _next_shift(63),
+	  _cleared(0),
+	  _old_buckets(NULL),
+	  _old_shift(63),
+	  _old_size(0),
+	  _migrated(0)
 {
 	if (_maxsize <= 0)
 		throw "LRUCacheH4: expecting cache size >= 1";
+	
+	_buckets = _allocate_buckets(_maxsize, _shift, true);
+	
+	if (pooled) {
+		_pool = static_cast<Val *>(::operator new(sizeof(Val) * _maxsize));
+		_pool_size = _maxsize;
+	}
 }
 
 
-template<class K, class V>
-LRUCacheH4<K, V>::LRUCacheH4(const LRUCacheH4<K, V> & other)
-	: _map(other._map.bucket_count(), __gnu_cxx::hash<K>(), std::equal_to<K>()),
-      _maxsize(other._maxsize),
+template<class K, class V, class W, class H, class E>
+LRUCacheH4<K, V, W, H, E>::LRUCacheH4(const LRUCacheH4<K, V, W, H, E> & other)
+	: _buckets(NULL),
+	  _shift(63),
+	  _size(0),
 	  _mru(NULL),
-	  _lru(NULL)
+	  _lru(NULL),
+	  _maxsize(other._maxsize),
+	  _resizing(false),
+	  _weight(0),
+	  _maxweight(other._maxweight),
+	  _weighted(other._weighted),
+	  _pool(NULL),
+	  _pool_size(0),
+	  _pool_used(0),
+	  _free(NULL),
+	  _clock(other._clock),
+	  _default_ttl(other._default_ttl),
+	  _wheel(NULL),
+	  _deferred(false),
+	  _next_buckets(NULL),
+	  _next_shift(63),
+	  _cleared(0),
+	  _old_buckets(NULL),
+	  _old_shift(63),
+	  _old_size(0),
+	  _migrated(0)
 {
-	for (const_iterator it = other.lru_begin();  it != other.end();  ++it)
-		this->insert(it.key(), it.value());
+	_buckets = _allocate_buckets(_maxsize, _shift, true);
+	
+	if (other.pooled()) {
+		_pool = static_cast<Val *>(::operator new(sizeof(Val) * _maxsize));
+		_pool_size = _maxsize;
+	}
+	
+	// entries keep their expiry; entries over a shrink still in progress are not copied
+	for (const Val * it = other._lru;  it;  it = it->second._newer) {
+		this->insert(it->first, it->second._v, 0);
+		if (it->second._expires)
+			_schedule(_mru, it->second._expires);
+	}
 }
 
 
-template<class K, class V>
-V & LRUCacheH4<K, V>::operator[](const K & key)
+template<class K, class V, class W, class H, class E>
+LRUCacheH4<K, V, W, H, E>::~LRUCacheH4()
+{
+	for (Val * node = _mru;  node; ) {
+		Val * older = node->second._older;
+		node->~Val();
+		_release(node);
+		node = older;
+	}
+	::operator delete(_pool);
+	std::free(_buckets);
+	std::free(_next_buckets);
+	std::free(_old_buckets);
+	delete _wheel;
+}
+
+
+template<class K, class V, class W, class H, class E>
+V & LRUCacheH4<K, V, W, H, E>::operator[](const K & key)
 {
-	return _update_or_insert(key)->second._v;
+	return _subscript(key);
 }
 
 
-template<class K, class V>
-void LRUCacheH4<K, V>::insert(const K & key, const V & value)
+template<class K, class V, class W, class H, class E>
+template<class Q>
+typename LRUCacheH4Lookup<H, E, Q, V &>::type LRUCacheH4<K, V, W, H, E>::operator[](const Q & key)
 {
-	_update_or_insert(key)->second._v = value;
+	return _subscript(key);
 }
 
 
-template<class K, class V>
-int LRUCacheH4<K, V>::size() const
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::insert(const K & key, const V & value)
+{
+	insert(key, value, _default_ttl);
+}
+
+
+// A value heavier than maxweight is not cached, and any previous value for
+// the key is dropped. Otherwise LRU entries are evicted until it fits.
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::insert(const K & key, const V & value, unsigned int ttl)
+{
+	const unsigned long weight = W()(value);
+	if (weight > _maxweight) {
+		if (Val * node = _lookup(key))
+			_erase(node, LRU_REPLACED);
+		return;
+	}
+	
+	Val * node = _lookup_live(key);
+	if (node) {
+		_notify(_update(node), LRU_REPLACED);
+		node->second._v = value;
+	}
+	else
+		node = _insert(key, value);
+	_charge(node, weight);
+	_set_ttl(node, ttl);
+}
+
+
+template<class K, class V, class W, class H, class E>
+template<class... Args>
+std::pair<typename LRUCacheH4<K, V, W, H, E>::const_iterator, bool>
+LRUCacheH4<K, V, W, H, E>::try_emplace(const K & key, Args &&... args)
+{
+	return _try_emplace(key, std::forward<Args>(args)...);
+}
+
+
+template<class K, class V, class W, class H, class E>
+template<class... Args>
+std::pair<typename LRUCacheH4<K, V, W, H, E>::const_iterator, bool>
+LRUCacheH4<K, V, W, H, E>::try_emplace(K && key, Args &&... args)
+{
+	return _try_emplace(std::move(key), std::forward<Args>(args)...);
+}
+
+
+template<class K, class V, class W, class H, class E>
+template<class... Args>
+std::pair<typename LRUCacheH4<K, V, W, H, E>::const_iterator, bool>
+LRUCacheH4<K, V, W, H, E>::emplace(K && key, Args &&... args)
+{
+	return _try_emplace(std::move(key), std::forward<Args>(args)...);
+}
+
+
+template<class K, class V, class W, class H, class E>
+template<class M>
+std::pair<typename LRUCacheH4<K, V, W, H, E>::const_iterator, bool>
+LRUCacheH4<K, V, W, H, E>::insert_or_assign(const K & key, M && value)
+{
+	return _insert_or_assign(key, std::forward<M>(value));
+}
+
+
+template<class K, class V, class W, class H, class E>
+template<class M>
+std::pair<typename LRUCacheH4<K, V, W, H, E>::const_iterator, bool>
+LRUCacheH4<K, V, W, H, E>::insert_or_assign(K && key, M && value)
+{
+	return _insert_or_assign(std::move(key), std::forward<M>(value));
+}
+
+
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::set_default_ttl(unsigned int ttl)
+{
+	_default_ttl = ttl;
+}
+
+
+template<class K, class V, class W, class H, class E>
+unsigned int LRUCacheH4<K, V, W, H, E>::default_ttl() const
+{
+	return _default_ttl;
+}
+
+
+template<class K, class V, class W, class H, class E>
+unsigned int LRUCacheH4<K, V, W, H, E>::ttl(const K & key) const
+{
+	const Val * node = _lookup(key);
+	if (!node || !node->second._expires || _expired(node))
+		return 0;
+	return node->second._expires - _clock();
+}
+
+
+// Pre-condition: the cache is empty, or the new clock agrees with the old one
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::set_clock(Clock clock)
+{
+	_clock = clock;
+}
+
+
+template<class K, class V, class W, class H, class E>
+int LRUCacheH4<K, V, W, H, E>::expire()
+{
+	return _wheel ? _expire(_clock()) : 0;
+}
+
+
+// Removals still queued are kept for the new listener
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::set_listener(const Listener & listener, bool deferred)
+{
+	_listener = listener;
+	_deferred = deferred;
+}
+
+
+// The listener may modify the cache: the queue is taken first
+template<class K, class V, class W, class H, class E>
+int LRUCacheH4<K, V, W, H, E>::deliver()
+{
+	Removals removals;
+	take_removals(removals);
+	for (size_t i = 0;  _listener && i < removals.size();  ++i)
+		_listener(removals[i]._key, removals[i]._v, removals[i]._cause);
+	return removals.size();
+}
+
+
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::take_removals(Removals & removals)
 {
-	return _map.size();
+	if (removals.empty())
+		removals.swap(_removed);
+	else {
+		for (size_t i = 0;  i < _removed.size();  ++i)
+			removals.push_back(std::move(_removed[i]));
+		_removed.clear();
+	}
 }
+
+
+// Growing a pooled cache does not move the pool: the extra nodes are
+// allocated one by one. A growth that needs a larger index while the
+// previous one is still in progress completes the previous one first.
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::set_maxsize(int maxsize, unsigned long maxweight)
+{
+	if (maxsize <= 0)
+		throw "LRUCacheH4: expecting cache size >= 1";
 	
+	if (size_t(maxsize) > size_t(1) << (64 - (_next_buckets ? _next_shift : _shift))) {
+		int shift;
+		Val ** buckets = _allocate_buckets(maxsize, shift, false);
+		_prepare(size_t(-1));
+		_migrate(_old_size);
+		_next_buckets = buckets;
+		_next_shift = shift;
+		_cleared = 0;
+	}
 	
-template<class K, class V>
-int LRUCacheH4<K, V>::maxsize() const 
+	_maxsize = maxsize;
+	if (maxweight)
+		_weighted = true;
+	_maxweight = maxweight ? maxweight : (_weighted ? _maxweight : maxsize);
+	_resizing = true;
+	_resize_step();
+}
+
+
+template<class K, class V, class W, class H, class E>
+bool LRUCacheH4<K, V, W, H, E>::resizing() const
+{
+	return _resizing;
+}
+
+
+template<class K, class V, class W, class H, class E>
+int LRUCacheH4<K, V, W, H, E>::size() const
+{
+	return _size;
+}
+	
+	
+template<class K, class V, class W, class H, class E>
+int LRUCacheH4<K, V, W, H, E>::maxsize() const 
 {
 	return _maxsize;
 }
 
 
-template<class K, class V>
-bool LRUCacheH4<K, V>::empty() const
+template<class K, class V, class W, class H, class E>
+bool LRUCacheH4<K, V, W, H, E>::empty() const
 {
 	return size() > 0;
 }
 
 
-// updates MRU
-template<class K, class V>
-typename LRUCacheH4<K, V>::const_iterator LRUCacheH4<K, V>::find(const K & key)
+template<class K, class V, class W, class H, class E>
+bool LRUCacheH4<K, V, W, H, E>::pooled() const
 {
-	typename MAP_TYPE::iterator it = _map.find(key);
+	return _pool != NULL;
+}
 
-	if (it != _map.end())
-		return const_iterator(_update(it), const_iterator::MRU_TO_LRU);
-	else
-		return end();
+
+template<class K, class V, class W, class H, class E>
+unsigned long LRUCacheH4<K, V, W, H, E>::weight() const
+{
+	return _weight;
+}
+
+
+template<class K, class V, class W, class H, class E>
+unsigned long LRUCacheH4<K, V, W, H, E>::maxweight() const
+{
+	return _maxweight;
+}
+
+
+// updates MRU
+template<class K, class V, class W, class H, class E>
+typename LRUCacheH4<K, V, W, H, E>::const_iterator LRUCacheH4<K, V, W, H, E>::find(const K & key)
+{
+	return _find(key);
 }
 
 
 // does not update MRU
-template<class K, class V>
-typename LRUCacheH4<K, V>::const_iterator LRUCacheH4<K, V>::find(const K & key) const
+template<class K, class V, class W, class H, class E>
+typename LRUCacheH4<K, V, W, H, E>::const_iterator LRUCacheH4<K, V, W, H, E>::find(const K & key) const
+{
+	return _find(key);
+}
+
+
+template<class K, class V, class W, class H, class E>
+template<class Q>
+typename LRUCacheH4Lookup<H, E, Q, typename LRUCacheH4<K, V, W, H, E>::const_iterator>::type
+LRUCacheH4<K, V, W, H, E>::find(const Q & key)
+{
+	return _find(key);
+}
+
+
+template<class K, class V, class W, class H, class E>
+template<class Q>
+typename LRUCacheH4Lookup<H, E, Q, typename LRUCacheH4<K, V, W, H, E>::const_iterator>::type
+LRUCacheH4<K, V, W, H, E>::find(const Q & key) const
 {
-	typename MAP_TYPE::iterator it = _map.find(key);
+	return _find(key);
+}
+
+
+// Three passes over each batch: prefetch the buckets, then prefetch the
+// first node of each chain and find the hits, then promote the hits
+template<class K, class V, class W, class H, class E>
+int LRUCacheH4<K, V, W, H, E>::multi_get(const K * keys, int n, const_iterator * found)
+{
+	Val ** buckets[PREFETCH_BATCH];
+	Val * nodes[PREFETCH_BATCH];
+	int ret = 0;
 	
-	if (it != _map.end())
-		return const_iterator(&*it, const_iterator::MRU_TO_LRU);
-	else
-		return end();
+	for (int first = 0;  first < n;  first += PREFETCH_BATCH) {
+		const int count = std::min(n - first, int(PREFETCH_BATCH));
+		_prefetch(keys + first, count, buckets);
+		
+		for (int i = 0;  i < count;  ++i) {
+			Val * node = *buckets[i];
+			while (node && !E()(node->first, keys[first + i]))
+				node = node->second._next;
+			if (!node && _old_buckets)
+				node = _lookup(keys[first + i]);
+			if (node && _expired(node)) {
+				// the clock may have moved since a repeat of the key found it live
+				for (int j = 0;  j < i;  ++j) {
+					if (nodes[j] == node)
+						nodes[j] = NULL;
+				}
+				_erase(node, LRU_EXPIRED);
+				node = NULL;
+			}
+			nodes[i] = node;
+			if (node) {
+				// the neighbours are written by the promotion
+				__builtin_prefetch(node->second._older, 1);
+				__builtin_prefetch(node->second._newer, 1);
+			}
+		}
+		
+		for (int i = 0;  i < count;  ++i) {
+			if (nodes[i]) {
+				PLB_LRU_COUNT(_hits);
+				found[first + i] = const_iterator(_update(nodes[i]), const_iterator::MRU_TO_LRU);
+				++ret;
+			}
+			else {
+				PLB_LRU_COUNT(_misses);
+				found[first + i] = end();
+			}
+		}
+	}
+	return ret;
 }
+
+
+// Only the lookups are prefetched: an insertion then finds its bucket in cache
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::multi_put(const K * keys, const V * values, int n)
+{
+	Val ** buckets[PREFETCH_BATCH];
 	
+	for (int first = 0;  first < n;  first += PREFETCH_BATCH) {
+		const int count = std::min(n - first, int(PREFETCH_BATCH));
+		_prefetch(keys + first, count, buckets);
+		for (int i = 0;  i < count;  ++i)
+			insert(keys[first + i], values[first + i]);
+	}
+}
 
-template<class K, class V>
-void LRUCacheH4<K, V>::dump_mru_to_lru(std::ostream & os) const
+
+template<class K, class V, class W, class H, class E>
+bool LRUCacheH4<K, V, W, H, E>::contains(const K & key) const
+{
+	return _find(key) != end();
+}
+
+
+template<class K, class V, class W, class H, class E>
+template<class Q>
+typename LRUCacheH4Lookup<H, E, Q, bool>::type LRUCacheH4<K, V, W, H, E>::contains(const Q & key) const
 {
-	os << "LRUCacheH4(" << size() << "/" << maxsize() << "): MRU --> LRU: " << std::endl;
+	return _find(key) != end();
+}
+
+
+template<class K, class V, class W, class H, class E>
+bool LRUCacheH4<K, V, W, H, E>::erase(const K & key)
+{
+	return _erase_key(key);
+}
+
+
+template<class K, class V, class W, class H, class E>
+template<class Q>
+typename LRUCacheH4Lookup<H, E, Q, bool>::type LRUCacheH4<K, V, W, H, E>::erase(const Q & key)
+{
+	return _erase_key(key);
+}
+	
+
+// One walk from the LRU end; an expired entry is erased all the same if
+// it matches, but does not count. pred must not modify the cache.
+template<class K, class V, class W, class H, class E>
+template<class P>
+int LRUCacheH4<K, V, W, H, E>::erase_if(P pred)
+{
+	int ret = 0;
+	for (Val * node = _lru;  node; ) {
+		Val * newer = node->second._newer;
+		if (pred(node->first, static_cast<const V &>(node->second._v))) {
+			const bool live = !_expired(node);
+			_erase(node, live ? LRU_ERASED : LRU_EXPIRED);
+			ret += live;
+		}
+		node = newer;
+	}
+	return ret;
+}
+
+
+// The listener is told of each entry, as for erase(). The index is cleared
+// in one pass rather than unlinked node by node.
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::clear()
+{
+	for (Val * node = _lru;  node; ) {
+		Val * newer = node->second._newer;
+		_notify(node, LRU_ERASED);
+		node->~Val();
+		_release(node);
+		node = newer;
+	}
+	_mru = _lru = NULL;
+	_size = 0;
+	_weight = 0;
+	
+	std::fill(_buckets, _buckets + (size_t(1) << (64 - _shift)), static_cast<Val *>(NULL));
+	std::free(_old_buckets);
+	_old_buckets = NULL;
+	_resizing = _next_buckets != NULL;
+}
+
+
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::dump_mru_to_lru(std::ostream & os) const
+{
+	os << "LRUCacheH4(" << size() << "/" << maxsize() << ", weight " << weight() << "/" << maxweight() << "): MRU --> LRU: " << std::endl;
 	for (const_iterator it = mru_begin();  it != end();  ++it)
 		os << it.key() << ": " << it.value() << std::endl;
 }
 
 
-template<class K, class V>
-typename LRUCacheH4<K, V>::const_iterator LRUCacheH4<K, V>::mru_begin() const
+template<class K, class V, class W, class H, class E>
+LRUCacheH4Stats LRUCacheH4<K, V, W, H, E>::stats() const
+{
+	return _stats;
+}
+
+
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::dump_stats(std::ostream & os) const
+{
+	os << "LRUCacheH4(" << size() << "/" << maxsize() << "): " << stats() << std::endl;
+}
+
+
+template<class K, class V, class W, class H, class E>
+typename LRUCacheH4<K, V, W, H, E>::const_iterator LRUCacheH4<K, V, W, H, E>::mru_begin() const
 {
 	return const_iterator(_mru, const_iterator::MRU_TO_LRU);
 }
 
 
-template<class K, class V>
-typename LRUCacheH4<K, V>::const_iterator LRUCacheH4<K, V>::lru_begin() const
+template<class K, class V, class W, class H, class E>
+typename LRUCacheH4<K, V, W, H, E>::const_iterator LRUCacheH4<K, V, W, H, E>::lru_begin() const
 {
 	return const_iterator(_lru, const_iterator::LRU_TO_MRU);
 }
 
 
-template<class K, class V>
-typename LRUCacheH4<K, V>::const_iterator LRUCacheH4<K, V>::end() const
+template<class K, class V, class W, class H, class E>
+typename LRUCacheH4<K, V, W, H, E>::const_iterator LRUCacheH4<K, V, W, H, E>::end() const
 {
 	return const_iterator();
 }
 
 
-template<class K, class V>
-typename LRUCacheH4<K, V>::Val * LRUCacheH4<K, V>::_update_or_insert(const K & key)
+// An existing entry keeps its expiry, a new one gets the default TTL.
+// A K is only built from key for a new entry.
+template<class K, class V, class W, class H, class E>
+template<class Q>
+V & LRUCacheH4<K, V, W, H, E>::_subscript(const Q & key)
+{
+	Val * node = _lookup_live(key);
+	if (node) {
+		PLB_LRU_COUNT(_hits);
+		return _update(node)->second._v;
+	}
+	
+	PLB_LRU_COUNT(_misses);
+	node = _insert(K(key));
+	_charge(node, W()(node->second._v));
+	_set_ttl(node, _default_ttl);
+	return node->second._v;
+}
+
+
+template<class K, class V, class W, class H, class E>
+template<class Q>
+typename LRUCacheH4<K, V, W, H, E>::const_iterator LRUCacheH4<K, V, W, H, E>::_find(const Q & key)
+{
+	Val * node = _lookup_live(key);
+
+	if (node) {
+		PLB_LRU_COUNT(_hits);
+		return const_iterator(_update(node), const_iterator::MRU_TO_LRU);
+	}
+	else {
+		PLB_LRU_COUNT(_misses);
+		return end();
+	}
+}
+
+
+template<class K, class V, class W, class H, class E>
+template<class Q>
+typename LRUCacheH4<K, V, W, H, E>::const_iterator LRUCacheH4<K, V, W, H, E>::_find(const Q & key) const
 {
-	typename MAP_TYPE::iterator it = _map.find(key);
-	if (it != _map.end())
-		return _update(it);
+	Val * node = _lookup(key);
+	
+	if (node && !_expired(node))
+		return const_iterator(node, const_iterator::MRU_TO_LRU);
+	else
+		return end();
+}
+
+
+// An expired entry is erased all the same, but does not count
+template<class K, class V, class W, class H, class E>
+template<class Q>
+bool LRUCacheH4<K, V, W, H, E>::_erase_key(const Q & key)
+{
+	Val * node = _lookup(key);
+	if (!node)
+		return false;
+	
+	bool ret = !_expired(node);
+	_erase(node, ret ? LRU_ERASED : LRU_EXPIRED);
+	return ret;
+}
+
+
+// An existing entry is only moved to the MRU position, and args are unused.
+// Values are built in place, unless they must be weighed first: then the
+// value is built, weighed, and moved into the node.
+template<class K, class V, class W, class H, class E>
+template<class KK, class... Args>
+std::pair<typename LRUCacheH4<K, V, W, H, E>::const_iterator, bool>
+LRUCacheH4<K, V, W, H, E>::_try_emplace(KK && key, Args &&... args)
+{
+	Val * node = _lookup_live(key);
+	if (node)
+		return std::make_pair(const_iterator(_update(node), const_iterator::MRU_TO_LRU), false);
+	
+	if constexpr (COUNTED)
+		return _admit(_insert(std::forward<KK>(key), std::forward<Args>(args)...), _default_ttl);
+	else {
+		V value(std::forward<Args>(args)...);
+		if (W()(value) > _maxweight)
+			return std::make_pair(end(), false);
+		return _admit(_insert(std::forward<KK>(key), std::move(value)), _default_ttl);
+	}
+}
+
+
+// An existing entry gets the new value and the default TTL, like insert().
+// As in insert(), a value too heavy to cache evicts nothing and only drops
+// the value it replaces.
+template<class K, class V, class W, class H, class E>
+template<class KK, class M>
+std::pair<typename LRUCacheH4<K, V, W, H, E>::const_iterator, bool>
+LRUCacheH4<K, V, W, H, E>::_insert_or_assign(KK && key, M && value)
+{
+	if constexpr (!COUNTED && !std::is_same<typename std::decay<M>::type, V>::value)
+		return _insert_or_assign(std::forward<KK>(key), V(std::forward<M>(value)));
+	else {
+		if constexpr (!COUNTED) {
+			if (W()(value) > _maxweight) {
+				if (Val * node = _lookup(key))
+					_erase(node, LRU_REPLACED);
+				return std::make_pair(end(), false);
+			}
+		}
+		
+		Val * node = _lookup_live(key);
+		if (node) {
+			_notify(_update(node), LRU_REPLACED);
+			node->second._v = std::forward<M>(value);
+			return _admit(node, _default_ttl);
+		}
+		
+		return _admit(_insert(std::forward<KK>(key), std::forward<M>(value)), _default_ttl);
+	}
+}
+
+
+// Charges the weight of the MRU node and sets its TTL. Pre-condition: the
+// value was weighed before any room was made for it, and fits.
+template<class K, class V, class W, class H, class E>
+std::pair<typename LRUCacheH4<K, V, W, H, E>::const_iterator, bool>
+LRUCacheH4<K, V, W, H, E>::_admit(Val * node, unsigned int ttl)
+{
+	const unsigned long weight = W()(node->second._v);
+	_charge(node, weight);
+	_set_ttl(node, ttl);
+	return std::make_pair(const_iterator(node, const_iterator::MRU_TO_LRU), true);
+}
+
+
+template<class K, class V, class W, class H, class E>
+typename LRUCacheH4<K, V, W, H, E>::Val * LRUCacheH4<K, V, W, H, E>::_update_or_insert(const K & key)
+{
+	Val * node = _lookup_live(key);
+	if (node)
+		return _update(node);
 	else
 		return _insert(key);
 }
 
 
-template<class K, class V>
-typename LRUCacheH4<K, V>::Val * LRUCacheH4<K, V>::_update(typename MAP_TYPE::iterator it)
+template<class K, class V, class W, class H, class E>
+typename LRUCacheH4<K, V, W, H, E>::Val * LRUCacheH4<K, V, W, H, E>::_update(Val * moved)
 {
-	LRUCacheH4Value<K, V> & v = it->second;
+	LRUCacheH4Value<K, V> & v = moved->second;
 	Val * older = v._older;
 	Val * newer = v._newer;
-	Val * moved = &*it;
 	
 	// possibly update the LRU
 	if (moved == _lru && _lru->second._newer)
@@ -337,35 +1356,404 @@ typename LRUCacheH4<K, V>::Val * LRUCacheH4<K, V>::_update(typename MAP_TYPE::it
 }
 
 
-template<class K, class V>
-typename LRUCacheH4<K, V>::Val * LRUCacheH4<K, V>::_insert(const K & key)
+// Builds the entry in place, from key and from args for the value. The
+// caller weighs it: a value too heavy to cache must not evict anything.
+template<class K, class V, class W, class H, class E>
+template<class KK, class... Args>
+typename LRUCacheH4<K, V, W, H, E>::Val * LRUCacheH4<K, V, W, H, E>::_insert(KK && key, Args &&... args)
 {
-	// if we have grown too large, remove LRU
-	if (_map.size() >= _maxsize) {
-		Val * old_lru = _lru;
-		if (_lru->second._newer) {
-			_lru = _lru->second._newer;
+	Val * node;
+	
+	// expired entries go first
+	if (_wheel)
+		_expire(_clock());
+	
+	// if we have grown too large, recycle the LRU node in place
+	if (_size >= _maxsize) {
+		node = _lru;
+		_lru = node->second._newer;
+		if (_lru)
 			_lru->second._older = NULL;
-		}
-		_map.erase(old_lru->first);
+		else
+			_mru = NULL;
+		_notify(node, LRU_EVICTED);
+		_unindex(node);
+		_weight -= node->second._weight;
+		node->~Val();
+		--_size;
 	}
+	else {
+		node = _acquire();
+	}
+	
+	try {
+		new (node) Val(std::piecewise_construct,
+		               std::forward_as_tuple(std::forward<KK>(key)),
+		               std::forward_as_tuple(std::in_place, std::forward<Args>(args)...));
+	}
+	catch (...) {
+		_release(node);
+		throw;
+	}
+	++_size;
+	_index(node);
+	PLB_LRU_COUNT(_inserts);
 	
 	// insert key to MRU position
-	std::pair<typename MAP_TYPE::iterator, bool> ret
-		= _map.insert_unique(Val(key, LRUCacheH4Value<K, V>(V(), _mru, NULL)));
-	Val * inserted = &*ret.first;
+	node->second._older = _mru;
 	if (_mru)
-		_mru->second._newer = inserted;
-	_mru = inserted;
+		_mru->second._newer = node;
+	_mru = node;
 	
 	// possibly update the LRU
 	if (!_lru)
 		_lru = _mru;
-	else if (!_lru->second._newer)
-		_lru->second._newer = _mru;
 	
-	return inserted;
+	return node;
+}
+
+
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::_erase(Val * node, LRUCacheH4Removal cause)
+{
+	_notify(node, cause);
+	if (node == _lru)
+		_lru = node->second._newer;
+	if (node == _mru)
+		_mru = node->second._older;
+	if (node->second._older)
+		node->second._older->second._newer = node->second._newer;
+	if (node->second._newer)
+		node->second._newer->second._older = node->second._older;
+	
+	_unindex(node);
+	_weight -= node->second._weight;
+	--_size;
+	node->~Val();
+	_release(node);
+}
+
+
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::_notify(Val * node, LRUCacheH4Removal cause)
+{
+	switch (cause) {
+		case LRU_EVICTED: PLB_LRU_COUNT(_evictions); break;
+		case LRU_ERASED: PLB_LRU_COUNT(_erasures); break;
+		case LRU_REPLACED: PLB_LRU_COUNT(_updates); break;
+		case LRU_EXPIRED: PLB_LRU_COUNT(_expirations); break;
+	}
+	if (!_listener)
+		return;
+	if (_deferred)
+		_removed.push_back(LRUCacheH4Removed<K, V>(node->first, std::move(node->second._v), cause));
+	else
+		_listener(node->first, node->second._v, cause);
+}
+
+
+// Re-weighs node and evicts from the LRU end until the total fits again.
+// While a shrink is in progress, the total only has to fit under what it
+// was: the rest of the excess is evicted by the resize steps.
+// Pre-condition: node is the MRU and weight <= maxweight, so it survives.
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::_charge(Val * node, unsigned long weight)
+{
+	const unsigned long limit = std::max(_maxweight, _weight);
+	_weight = _weight - node->second._weight + weight;
+	node->second._weight = weight;
+	while (_weight > limit && _lru != node)
+		_erase(_lru, LRU_EVICTED);
+}
+
+
+// Erases the entry if it has expired: the clock is only read for entries
+// that have an expiry
+template<class K, class V, class W, class H, class E>
+template<class Q>
+typename LRUCacheH4<K, V, W, H, E>::Val * LRUCacheH4<K, V, W, H, E>::_lookup_live(const Q & key)
+{
+	if (_resizing)
+		_resize_step();
+	
+	Val * node = _lookup(key);
+	if (node && _expired(node)) {
+		_erase(node, LRU_EXPIRED);
+		return NULL;
+	}
+	return node;
+}
+
+
+template<class K, class V, class W, class H, class E>
+bool LRUCacheH4<K, V, W, H, E>::_expired(const Val * node) const
+{
+	return node->second._expires && int32_t(node->second._expires - _clock()) <= 0;
+}
+
+
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::_set_ttl(Val * node, unsigned int ttl)
+{
+	if (ttl == 0) {
+		node->second._expires = 0;
+		return;
+	}
+	
+	uint32_t expires = _clock() + ttl;
+	_schedule(node, expires ? expires : 1);
+}
+
+
+// An entry has one timer pending: a later expiry waits for it to fire, and
+// is scheduled then; only an earlier one takes a new timer, leaving the
+// pending one stale. Updating a TTL takes no memory in the wheel.
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::_schedule(Val * node, uint32_t expires)
+{
+	if (!_wheel)
+		_wheel = new LRUCacheH4TimerWheel<K>(_clock());
+	node->second._expires = expires;
+	const uint32_t pending = node->second._scheduled;
+	if (pending && int32_t(pending - expires) <= 0)
+		return;
+	node->second._scheduled = expires;
+	_wheel->schedule(node->first, expires);
+}
+
+
+// Timers whose entry is gone or has another timer pending are stale
+template<class K, class V, class W, class H, class E>
+int LRUCacheH4<K, V, W, H, E>::_expire(uint32_t now)
+{
+	int ret = 0;
+	_due.clear();
+	_wheel->advance(now, _due, [this](const K & key, uint32_t expires) {
+		const Val * node = _lookup(key);
+		return node && node->second._scheduled == expires;
+	});
+	for (size_t i = 0;  i < _due.size();  ++i) {
+		Val * node = _lookup(_due[i].first);
+		if (!node || node->second._scheduled != _due[i].second)
+			continue;
+		node->second._scheduled = 0;
+		if (node->second._expires == _due[i].second) {
+			_erase(node, LRU_EXPIRED);
+			++ret;
+		}
+		else if (node->second._expires) {
+			_schedule(node, node->second._expires);
+		}
+	}
+	return ret;
+}
+
+
+// Fibonacci hashing: __gnu_cxx::hash is the identity for integers, so use
+// the high bits of a multiplicative mix rather than the low bits of the key
+template<class K, class V, class W, class H, class E>
+template<class Q>
+typename LRUCacheH4<K, V, W, H, E>::Val ** LRUCacheH4<K, V, W, H, E>::_bucket(const Q & key) const
+{
+	uint64_t h = H()(key);
+	return &_buckets[size_t((h * 0x9E3779B97F4A7C15ULL) >> _shift)];
+}
+
+
+// Pre-condition: the index is growing
+template<class K, class V, class W, class H, class E>
+template<class Q>
+typename LRUCacheH4<K, V, W, H, E>::Val ** LRUCacheH4<K, V, W, H, E>::_old_bucket(const Q & key) const
+{
+	uint64_t h = H()(key);
+	return &_old_buckets[size_t((h * 0x9E3779B97F4A7C15ULL) >> _old_shift)];
+}
+
+
+// A power of 2 buckets, at least maxsize and at least 2, so that shift is
+// less than 64; shift is set to 64 - log2 of it. Unless clear, the buckets
+// are left uninitialized: clearing a large index, in calloc() or as its
+// pages are first touched, would stall the caller.
+template<class K, class V, class W, class H, class E>
+typename LRUCacheH4<K, V, W, H, E>::Val ** LRUCacheH4<K, V, W, H, E>::_allocate_buckets(int maxsize, int & shift, bool clear)
+{
+	size_t buckets = 2;
+	for (shift = 63;  buckets < size_t(maxsize);  buckets <<= 1)
+		--shift;
+	void * ret = clear ? std::calloc(buckets, sizeof(Val *)) : std::malloc(buckets * sizeof(Val *));
+	if (!ret)
+		throw std::bad_alloc();
+	return static_cast<Val **>(ret);
+}
+
+
+// Hashes the keys and prefetches their buckets, then the first node of
+// each non-empty bucket: by then most buckets have arrived
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::_prefetch(const K * keys, int n, Val ** buckets[]) const
+{
+	for (int i = 0;  i < n;  ++i) {
+		buckets[i] = _bucket(keys[i]);
+		__builtin_prefetch(buckets[i]);
+	}
+	for (int i = 0;  i < n;  ++i) {
+		if (*buckets[i])
+			__builtin_prefetch(*buckets[i]);
+	}
+}
+
+
+// While the index grows, new entries go to the new index: the old one is
+// only searched on a miss, until its buckets have all been moved
+template<class K, class V, class W, class H, class E>
+template<class Q>
+typename LRUCacheH4<K, V, W, H, E>::Val * LRUCacheH4<K, V, W, H, E>::_lookup(const Q & key) const
+{
+	Val * node = *_bucket(key);
+	while (node && !E()(node->first, key))
+		node = node->second._next;
+	if (__builtin_expect(!node && _resizing, 0) && _old_buckets) {
+		node = *_old_bucket(key);
+		while (node && !E()(node->first, key))
+			node = node->second._next;
+	}
+	return node;
+}
+
+
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::_index(Val * node)
+{
+	Val ** bucket = _bucket(node->first);
+	node->second._next = *bucket;
+	*bucket = node;
+}
+
+
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::_unindex(Val * node)
+{
+	if (__builtin_expect(_resizing, 0) && _old_buckets) {
+		_unindex_growing(node);
+		return;
+	}
+	
+	Val ** link = _bucket(node->first);
+	while (*link != node)
+		link = &(*link)->second._next;
+	*link = node->second._next;
+}
+
+
+// The node is in the new index, or in the old one if its bucket is not moved yet
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::_unindex_growing(Val * node)
+{
+	Val ** link = _bucket(node->first);
+	while (*link && *link != node)
+		link = &(*link)->second._next;
+	if (!*link) {
+		link = _old_bucket(node->first);
+		while (*link != node)
+			link = &(*link)->second._next;
+	}
+	*link = node->second._next;
+}
+
+
+// Pre-condition: _resizing
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::_resize_step()
+{
+	if (_next_buckets)
+		_prepare(CLEAR_STEP);
+	else
+		_migrate(RESIZE_STEP);
+	for (int i = 0;  i < RESIZE_STEP && _lru && (_size > _maxsize || _weight > _maxweight);  ++i)
+		_erase(_lru, LRU_EVICTED);
+	_resizing = _next_buckets || _old_buckets || _size > _maxsize || _weight > _maxweight;
+}
+
+
+// Clears up to n buckets of the next index; once all are, it becomes the
+// index, and the current one the old one, to be moved
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::_prepare(size_t n)
+{
+	if (!_next_buckets)
+		return;
+	
+	const size_t size = size_t(1) << (64 - _next_shift);
+	const size_t end = n < size - _cleared ? _cleared + n : size;
+	std::fill(_next_buckets + _cleared, _next_buckets + end, static_cast<Val *>(NULL));
+	_cleared = end;
+	if (_cleared < size)
+		return;
+	
+	_old_buckets = _buckets;
+	_old_shift = _shift;
+	_old_size = size_t(1) << (64 - _shift);
+	_migrated = 0;
+	_buckets = _next_buckets;
+	_shift = _next_shift;
+	_next_buckets = NULL;
+}
+
+
+// Moves up to n old buckets to the new index; frees the old index once empty
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::_migrate(size_t n)
+{
+	for (;  _old_buckets && n > 0;  --n) {
+		Val * node = _old_buckets[_migrated++];
+		while (node) {
+			Val * next = node->second._next;
+			_index(node);
+			node = next;
+		}
+		if (_migrated == _old_size) {
+			std::free(_old_buckets);
+			_old_buckets = NULL;
+		}
+	}
+}
+
+
+// Returns uninitialized storage for one node
+template<class K, class V, class W, class H, class E>
+typename LRUCacheH4<K, V, W, H, E>::Val * LRUCacheH4<K, V, W, H, E>::_acquire()
+{
+	if (!_pool)
+		return static_cast<Val *>(::operator new(sizeof(Val)));
+	
+	if (_free) {
+		Val * node = _free;
+		_free = *reinterpret_cast<Val **>(node);
+		return node;
+	}
+	
+	if (_pool_used < _pool_size)
+		return _pool + _pool_used++;
+	return static_cast<Val *>(::operator new(sizeof(Val)));
+}
+
+
+// Pre-condition: node has been destroyed
+template<class K, class V, class W, class H, class E>
+void LRUCacheH4<K, V, W, H, E>::_release(Val * node)
+{
+	if (!_pool || node < _pool || node >= _pool + _pool_size) {
+		::operator delete(node);
+	}
+	else {
+		new (static_cast<void *>(node)) Val *(_free);
+		_free = node;
+	}
 }
 
 
 }  // namespace plb
+
+#undef PLB_LRU_COUNT
+
+#endif  // PLB_LRU_HPP
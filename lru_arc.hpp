@@ -0,0 +1,394 @@
+/*
+ * Implementation of an ARC (Adaptive Replacement Cache) with a maximum size.
+ *
+ * Same interface as LRUCacheH4. Resident entries are split between T1, seen
+ * once recently, and T2, seen at least twice. B1 and B2 remember the keys
+ * (not the values) recently evicted from T1 and T2. A miss that hits a
+ * ghost list moves the target size of T1 towards the list that would have
+ * kept the entry, so the cache adapts between recency and frequency.
+ *
+ * Reference: N. Megiddo, D. Modha, "ARC: A Self-Tuning, Low Overhead
+ * Replacement Cache", FAST 2003.
+ *
+ * See http://code.google.com/p/lru-cache-cpp/ for usage and limitations.
+ *
+ * Licensed under the GNU LGPL: http://www.gnu.org/copyleft/lesser.html
+ *
+ */
+
+#ifndef PLB_LRU_ARC_HPP
+#define PLB_LRU_ARC_HPP
+
+#include <hashtable.h>
+#include <algorithm>
+#include <sstream>
+#include <cassert>
+
+namespace {
+
+//-------------------------------------------------------------
+// Bucket
+//-------------------------------------------------------------
+
+enum ARCList {
+	ARC_T1 = 0,
+	ARC_T2,
+	ARC_B1,
+	ARC_B2
+};
+
+template<class K, class V>
+struct ARCCacheValue
+{
+	typedef std::pair<const K, ARCCacheValue<K, V> > Val;
+
+	ARCCacheValue()
+		: _v(), _list(ARC_T1), _older(NULL), _newer(NULL) { }
+
+	V _v;              // V() while the key is a ghost
+	ARCList _list;
+	Val * _older;
+	Val * _newer;
+};
+
+
+// One of the four lists, threaded through the nodes like LRUCacheH4's
+template<class K, class V>
+struct ARCCacheList
+{
+	typedef std::pair<const K, ARCCacheValue<K, V> > Val;
+
+	ARCCacheList() : _mru(NULL), _lru(NULL), _size(0) { }
+
+	void push_mru(Val * node)
+	{
+		node->second._older = _mru;
+		node->second._newer = NULL;
+		if (_mru)
+			_mru->second._newer = node;
+		_mru = node;
+		if (!_lru)
+			_lru = node;
+		++_size;
+	}
+
+	void unlink(Val * node)
+	{
+		ARCCacheValue<K, V> & v = node->second;
+		if (v._older)
+			v._older->second._newer = v._newer;
+		else
+			_lru = v._newer;
+		if (v._newer)
+			v._newer->second._older = v._older;
+		else
+			_mru = v._older;
+		--_size;
+	}
+
+	Val * _mru;
+	Val * _lru;
+	int _size;
+};
+
+
+//-------------------------------------------------------------
+// Const Iterator
+//-------------------------------------------------------------
+
+// Walks from MRU to LRU, then on to the MRU of the next list if any
+template<class K, class V>
+class ARCCacheConstIterator
+{
+public:
+	typedef std::pair<const K, ARCCacheValue<K, V> > Val;
+	typedef ARCCacheConstIterator<K, V> const_iterator;
+
+	ARCCacheConstIterator(const Val * ptr = NULL, const Val * then = NULL)
+		: _ptr(ptr ? ptr : then), _then(ptr ? then : NULL) { }
+
+	const_iterator & operator++()
+	{
+		assert(_ptr);
+		_ptr = _ptr->second._older;
+		if (!_ptr) {
+			_ptr = _then;
+			_then = NULL;
+		}
+		return *this;
+	}
+
+	const_iterator operator++(int)
+	{
+		const_iterator ret = *this;
+		++*this;
+		return ret;
+	}
+
+	bool operator==(const const_iterator & other) { return _ptr == other._ptr; }
+	bool operator!=(const const_iterator & other) { return _ptr != other._ptr; }
+
+	const K & key() const { assert(_ptr); return _ptr->first; }
+	const V & value() const { assert(_ptr); return _ptr->second._v; }
+
+private:
+	const Val * _ptr;
+	const Val * _then;
+};
+
+} // file scope
+
+
+namespace plb {
+
+//-------------------------------------------------------------
+// ARC Cache
+//-------------------------------------------------------------
+
+template<class K, class V>
+class ARCCache
+{
+public:
+	typedef ARCCacheConstIterator<K, V> const_iterator;
+
+public:
+	ARCCache(int maxsize);                      // Pre-condition: maxsize >= 1
+
+	V & operator[](const K & key);
+	void insert(const K & key, const V & value);
+
+	int size() const;                           // resident entries
+	int maxsize() const;
+	bool empty() const;
+	int target() const;                         // adaptive target size of T1
+
+	const_iterator find(const K & key);         // a hit is an access
+	const_iterator find(const K & key) const;   // not an access
+	const_iterator begin() const;               // T2 then T1, each from MRU to LRU
+	const_iterator end() const;
+
+	void dump(std::ostream & os) const;
+
+private:
+	typedef std::pair<const K, ARCCacheValue<K, V> > Val;
+	typedef ARCCacheList<K, V> List;
+	typedef __gnu_cxx::hashtable<Val, K, __gnu_cxx::hash<K>, std::_Select1st<Val>, std::equal_to<K> > MAP_TYPE;
+
+private:
+	ARCCache(const ARCCache & other);
+	ARCCache & operator=(const ARCCache & other);
+
+	Val * _access(const K & key);
+	void _move(Val * node, ARCList to);
+	void _replace(bool in_b2);
+	void _forget(List & ghosts);
+
+private:
+	MAP_TYPE _map;                              // resident entries and ghosts
+	List _lists[4];
+	int _p;
+	int _maxsize;
+};
+
+
+// Reserve enough space for the entries and the ghosts: the hashtable never
+// resizes, so the list pointers into its nodes stay valid
+template<class K, class V>
+ARCCache<K, V>::ARCCache(int maxsize)
+	: _map(2 * maxsize, __gnu_cxx::hash<K>(), std::equal_to<K>()),
+	  _p(0),
+	  _maxsize(maxsize)
+{
+	if (_maxsize <= 0)
+		throw "ARCCache: expecting cache size >= 1";
+}
+
+
+template<class K, class V>
+V & ARCCache<K, V>::operator[](const K & key)
+{
+	return _access(key)->second._v;
+}
+
+
+template<class K, class V>
+void ARCCache<K, V>::insert(const K & key, const V & value)
+{
+	_access(key)->second._v = value;
+}
+
+
+template<class K, class V>
+int ARCCache<K, V>::size() const
+{
+	return _lists[ARC_T1]._size + _lists[ARC_T2]._size;
+}
+
+
+template<class K, class V>
+int ARCCache<K, V>::maxsize() const
+{
+	return _maxsize;
+}
+
+
+template<class K, class V>
+bool ARCCache<K, V>::empty() const
+{
+	return size() == 0;
+}
+
+
+template<class K, class V>
+int ARCCache<K, V>::target() const
+{
+	return _p;
+}
+
+
+// A miss, including a ghost hit, changes nothing: the caller is expected to
+// insert the value, which is when the ghost is taken into account
+template<class K, class V>
+typename ARCCache<K, V>::const_iterator ARCCache<K, V>::find(const K & key)
+{
+	typename MAP_TYPE::iterator it = _map.find(key);
+	if (it == _map.end() || it->second._list >= ARC_B1)
+		return end();
+
+	_move(&*it, ARC_T2);
+	return const_iterator(&*it);
+}
+
+
+template<class K, class V>
+typename ARCCache<K, V>::const_iterator ARCCache<K, V>::find(const K & key) const
+{
+	typename MAP_TYPE::const_iterator it = _map.find(key);
+	if (it == _map.end() || it->second._list >= ARC_B1)
+		return end();
+	return const_iterator(&*it);
+}
+
+
+template<class K, class V>
+typename ARCCache<K, V>::const_iterator ARCCache<K, V>::begin() const
+{
+	return const_iterator(_lists[ARC_T2]._mru, _lists[ARC_T1]._mru);
+}
+
+
+template<class K, class V>
+typename ARCCache<K, V>::const_iterator ARCCache<K, V>::end() const
+{
+	return const_iterator();
+}
+
+
+template<class K, class V>
+void ARCCache<K, V>::dump(std::ostream & os) const
+{
+	static const char * names[] = { "T1", "T2", "B1", "B2" };
+	os << "ARCCache(" << size() << "/" << maxsize() << ", p=" << _p << ")" << std::endl;
+	for (int l = ARC_T1;  l <= ARC_B2;  ++l) {
+		os << names[l] << " (" << _lists[l]._size << "): MRU --> LRU: ";
+		for (const Val * node = _lists[l]._mru;  node;  node = node->second._older)
+			os << node->first << " ";
+		os << std::endl;
+	}
+}
+
+
+// The four cases of the ARC request procedure
+template<class K, class V>
+typename ARCCache<K, V>::Val * ARCCache<K, V>::_access(const K & key)
+{
+	const int c = _maxsize;
+	List & t1 = _lists[ARC_T1];
+	List & b1 = _lists[ARC_B1];
+	List & b2 = _lists[ARC_B2];
+
+	typename MAP_TYPE::iterator it = _map.find(key);
+	if (it != _map.end()) {
+		Val * node = &*it;
+		switch (node->second._list) {
+			case ARC_B1:
+				// recency would have kept it: grow T1
+				_p = std::min(c, _p + std::max(b2._size / b1._size, 1));
+				_replace(false);
+				break;
+			case ARC_B2:
+				// frequency would have kept it: shrink T1
+				_p = std::max(0, _p - std::max(b1._size / b2._size, 1));
+				_replace(true);
+				break;
+			default:
+				break;
+		}
+		_move(node, ARC_T2);
+		return node;
+	}
+
+	// a new key
+	if (t1._size + b1._size == c) {
+		if (t1._size < c) {
+			_forget(b1);
+			_replace(false);
+		}
+		else {
+			Val * victim = t1._lru;
+			t1.unlink(victim);
+			_map.erase(victim->first);
+		}
+	}
+	else if (t1._size + b1._size + _lists[ARC_T2]._size + b2._size >= c) {
+		if (t1._size + b1._size + _lists[ARC_T2]._size + b2._size == 2 * c)
+			_forget(b2);
+		_replace(false);
+	}
+
+	Val * node = &*_map.insert_unique(Val(key, ARCCacheValue<K, V>())).first;
+	node->second._list = ARC_T1;
+	t1.push_mru(node);
+	return node;
+}
+
+
+template<class K, class V>
+void ARCCache<K, V>::_move(Val * node, ARCList to)
+{
+	_lists[node->second._list].unlink(node);
+	node->second._list = to;
+	_lists[to].push_mru(node);
+}
+
+
+// Evicts the LRU of T1 or T2 into its ghost list, dropping the value
+template<class K, class V>
+void ARCCache<K, V>::_replace(bool in_b2)
+{
+	const List & t1 = _lists[ARC_T1];
+	if (t1._size > 0 && (t1._size > _p || (in_b2 && t1._size == _p))) {
+		Val * victim = t1._lru;
+		_move(victim, ARC_B1);
+		victim->second._v = V();
+	}
+	else if (_lists[ARC_T2]._size > 0) {
+		Val * victim = _lists[ARC_T2]._lru;
+		_move(victim, ARC_B2);
+		victim->second._v = V();
+	}
+}
+
+
+template<class K, class V>
+void ARCCache<K, V>::_forget(List & ghosts)
+{
+	Val * victim = ghosts._lru;
+	ghosts.unlink(victim);
+	_map.erase(victim->first);
+}
+
+
+}  // namespace plb
+
+#endif  // PLB_LRU_ARC_HPP
@@ -0,0 +1,365 @@
+/*
+ * Thread-safe approximate LRU cache using the CLOCK (second chance)
+ * replacement policy.
+ *
+ * Entries live in a fixed ring of slots. A hit only sets the reference bit
+ * of its slot, with a relaxed atomic store, so readers never write to the
+ * recency state of their neighbours. Only misses take the writers' mutex:
+ * the hand sweeps the ring, clearing reference bits, until it finds a slot
+ * that has not been referenced since the previous sweep and evicts it.
+ *
+ * Reads take no lock at all. The index is an open-addressing table of
+ * atomic slot numbers, and a sequence counter (a seqlock) is odd while a
+ * writer changes the index or a slot: a reader copies the value, then
+ * retries if the counter moved meanwhile. After a few failed attempts, it
+ * takes the mutex, so that a stream of writes cannot starve it.
+ *
+ * Limitations: K and V must be trivially copyable, since readers may copy
+ * them while a writer overwrites them (the copy is then discarded).
+ *
+ * See http://code.google.com/p/lru-cache-cpp/ for usage and limitations.
+ *
+ * Licensed under the GNU LGPL: http://www.gnu.org/copyleft/lesser.html
+ *
+ */
+
+#ifndef PLB_LRU_CLOCK_HPP
+#define PLB_LRU_CLOCK_HPP
+
+#include <hashtable.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace plb {
+
+//-------------------------------------------------------------
+// CLOCK Cache
+//-------------------------------------------------------------
+
+template<class K, class V>
+class ClockCache
+{
+	static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+	              "ClockCache: K and V must be trivially copyable");
+
+public:
+	ClockCache(int maxsize);                        // Pre-condition: 1 <= maxsize < 2^30
+
+	// Values are returned by copy: a reference would see later writes
+	V operator[](const K & key);
+	void insert(const K & key, const V & value);
+
+	bool find(const K & key, V & value) const;      // sets the reference bit, takes no lock
+	bool contains(const K & key) const;             // does not set the reference bit
+
+	int size() const;
+	int maxsize() const;
+	bool empty() const;
+
+	void dump(std::ostream & os) const;             // in ring order, from the hand
+
+private:
+	static const uint32_t EMPTY = 0;                // index entries are slot numbers + 1
+	static const int RETRIES = 4;                   // optimistic reads before taking the mutex
+
+	struct Slot
+	{
+		Slot() : _key(), _v(), _ref(0) { }
+
+		K _key;
+		V _v;
+		mutable std::atomic<unsigned char> _ref;
+	};
+
+	typedef std::lock_guard<std::mutex> Lock;
+
+private:
+	ClockCache(const ClockCache & other);
+	ClockCache & operator=(const ClockCache & other);
+
+	bool _read(const K & key, V * value, bool reference) const;
+	int _lookup(const K & key) const;           // slot, or -1
+	uint32_t _bucket(const K & key) const;
+	void _begin_write();
+	void _end_write();
+
+	Slot & _find_or_insert(const K & key);
+	int _evict();
+	void _index(const K & key, int slot);
+	void _unindex(const K & key);
+
+private:
+	mutable std::mutex _mutex;                  // writers, and readers out of retries
+	std::atomic<uint32_t> _seq;                 // odd while a writer is at work
+	std::vector<Slot> _slots;
+	std::unique_ptr<std::atomic<uint32_t>[]> _buckets;
+	uint32_t _mask;                             // buckets - 1
+	int _shift;                                 // 64 - log2(buckets)
+	std::atomic<int> _size;
+	int _hand;
+	int _maxsize;
+};
+
+
+// The index is a power of two at least twice maxsize, allocated once
+template<class K, class V>
+ClockCache<K, V>::ClockCache(int maxsize)
+	: _seq(0),
+	  _slots(maxsize > 0 ? maxsize : 0),
+	  _mask(1),
+	  _shift(63),
+	  _size(0),
+	  _hand(0),
+	  _maxsize(maxsize)
+{
+	if (_maxsize <= 0)
+		throw "ClockCache: expecting cache size >= 1";
+
+	while (_mask + 1 < 2 * uint32_t(_maxsize)) {
+		_mask = (_mask << 1) | 1;
+		--_shift;
+	}
+	_buckets.reset(new std::atomic<uint32_t>[_mask + 1]);
+	for (uint32_t b = 0;  b <= _mask;  ++b)
+		_buckets[b].store(EMPTY, std::memory_order_relaxed);
+}
+
+
+template<class K, class V>
+V ClockCache<K, V>::operator[](const K & key)
+{
+	V ret;
+	if (find(key, ret))
+		return ret;
+
+	Lock lock(_mutex);
+	_begin_write();
+	ret = _find_or_insert(key)._v;
+	_end_write();
+	return ret;
+}
+
+
+template<class K, class V>
+void ClockCache<K, V>::insert(const K & key, const V & value)
+{
+	Lock lock(_mutex);
+	_begin_write();
+	_find_or_insert(key)._v = value;
+	_end_write();
+}
+
+
+template<class K, class V>
+bool ClockCache<K, V>::find(const K & key, V & value) const
+{
+	return _read(key, &value, true);
+}
+
+
+template<class K, class V>
+bool ClockCache<K, V>::contains(const K & key) const
+{
+	return _read(key, 0, false);
+}
+
+
+template<class K, class V>
+int ClockCache<K, V>::size() const
+{
+	return _size.load(std::memory_order_relaxed);
+}
+
+
+template<class K, class V>
+int ClockCache<K, V>::maxsize() const
+{
+	return _maxsize;
+}
+
+
+template<class K, class V>
+bool ClockCache<K, V>::empty() const
+{
+	return size() == 0;
+}
+
+
+template<class K, class V>
+void ClockCache<K, V>::dump(std::ostream & os) const
+{
+	Lock lock(_mutex);
+	const int n = size();
+	os << "ClockCache(" << n << "/" << maxsize() << "): hand --> " << std::endl;
+	for (int i = 0;  i < n;  ++i) {
+		const Slot & s = _slots[(_hand + i) % n];
+		os << s._key << ": " << s._v << " [" << int(s._ref.load(std::memory_order_relaxed)) << "]" << std::endl;
+	}
+}
+
+
+// Seqlock read: the lookup and the copy only count if no writer started or
+// finished meanwhile. The reference bit is only loaded and, if needed,
+// stored: an entry that is hit repeatedly between two sweeps does not keep
+// dirtying its cache line.
+template<class K, class V>
+bool ClockCache<K, V>::_read(const K & key, V * value, bool reference) const
+{
+	int slot = -1;
+	V copy = V();
+	bool valid = false;
+	for (int attempt = 0;  attempt < RETRIES && !valid;  ++attempt) {
+		const uint32_t seq = _seq.load(std::memory_order_acquire);
+		if (seq & 1) {
+			std::this_thread::yield();
+			continue;
+		}
+		slot = _lookup(key);
+		if (slot >= 0 && value)
+			copy = _slots[slot]._v;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		valid = _seq.load(std::memory_order_relaxed) == seq;
+	}
+
+	if (!valid) {
+		Lock lock(_mutex);
+		slot = _lookup(key);
+		if (slot >= 0 && value)
+			copy = _slots[slot]._v;
+	}
+
+	if (slot < 0)
+		return false;
+	if (reference && !_slots[slot]._ref.load(std::memory_order_relaxed))
+		_slots[slot]._ref.store(1, std::memory_order_relaxed);
+	if (value)
+		*value = copy;
+	return true;
+}
+
+
+// Bounded: while a writer is at work, a reader may see no empty bucket
+template<class K, class V>
+int ClockCache<K, V>::_lookup(const K & key) const
+{
+	uint32_t b = _bucket(key);
+	for (uint32_t n = 0;  n <= _mask;  ++n, b = (b + 1) & _mask) {
+		const uint32_t entry = _buckets[b].load(std::memory_order_relaxed);
+		if (entry == EMPTY)
+			return -1;
+		if (_slots[entry - 1]._key == key)
+			return entry - 1;
+	}
+	return -1;
+}
+
+
+// Fibonacci hashing, as in LRUCacheFlat
+template<class K, class V>
+uint32_t ClockCache<K, V>::_bucket(const K & key) const
+{
+	uint64_t h = __gnu_cxx::hash<K>()(key);
+	return uint32_t((h * 0x9E3779B97F4A7C15ULL) >> _shift) & _mask;
+}
+
+
+// Pre-condition: the mutex is held
+template<class K, class V>
+void ClockCache<K, V>::_begin_write()
+{
+	_seq.store(_seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+}
+
+
+template<class K, class V>
+void ClockCache<K, V>::_end_write()
+{
+	_seq.store(_seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+
+// Pre-condition: the mutex is held, within _begin_write() and _end_write()
+template<class K, class V>
+typename ClockCache<K, V>::Slot & ClockCache<K, V>::_find_or_insert(const K & key)
+{
+	int slot = _lookup(key);
+	if (slot >= 0) {
+		Slot & s = _slots[slot];
+		s._ref.store(1, std::memory_order_relaxed);
+		return s;
+	}
+
+	// slots are filled in order until the ring is full, then recycled by the hand
+	const int size = _size.load(std::memory_order_relaxed);
+	slot = size < _maxsize ? size : _evict();
+	Slot & s = _slots[slot];
+	s._key = key;
+	s._v = V();
+	s._ref.store(0, std::memory_order_relaxed);
+	_index(key, slot);
+	if (size < _maxsize)
+		_size.store(size + 1, std::memory_order_relaxed);
+	return s;
+}
+
+
+// Pre-condition: the mutex is held and the ring is full
+// Lock-free readers may set bits again behind the hand, so the sweep stops
+// after one full turn and evicts the slot under the hand, referenced or not
+template<class K, class V>
+int ClockCache<K, V>::_evict()
+{
+	for (int n = 0;  n < _maxsize && _slots[_hand]._ref.load(std::memory_order_relaxed);  ++n) {
+		_slots[_hand]._ref.store(0, std::memory_order_relaxed);
+		_hand = (_hand + 1) % _maxsize;
+	}
+
+	int victim = _hand;
+	_hand = (_hand + 1) % _maxsize;
+	_unindex(_slots[victim]._key);
+	return victim;
+}
+
+
+template<class K, class V>
+void ClockCache<K, V>::_index(const K & key, int slot)
+{
+	uint32_t b = _bucket(key);
+	while (_buckets[b].load(std::memory_order_relaxed) != EMPTY)
+		b = (b + 1) & _mask;
+	_buckets[b].store(slot + 1, std::memory_order_relaxed);
+}
+
+
+// Backward shift deletion, as in LRUCacheFlat: no tombstones
+template<class K, class V>
+void ClockCache<K, V>::_unindex(const K & key)
+{
+	uint32_t hole = _bucket(key);
+	while (!(_slots[_buckets[hole].load(std::memory_order_relaxed) - 1]._key == key))
+		hole = (hole + 1) & _mask;
+
+	for (uint32_t b = (hole + 1) & _mask;  ;  b = (b + 1) & _mask) {
+		const uint32_t entry = _buckets[b].load(std::memory_order_relaxed);
+		if (entry == EMPTY)
+			break;
+		const uint32_t home = _bucket(_slots[entry - 1]._key);
+		if (((b - home) & _mask) >= ((b - hole) & _mask)) {
+			_buckets[hole].store(entry, std::memory_order_relaxed);
+			hole = b;
+		}
+	}
+	_buckets[hole].store(EMPTY, std::memory_order_relaxed);
+}
+
+
+}  // namespace plb
+
+#endif  // PLB_LRU_CLOCK_HPP
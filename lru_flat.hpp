@@ -0,0 +1,431 @@
+/*
+ * Implementation of an LRU cache with a maximum size, using flat storage.
+ *
+ * Same interface as LRUCacheH4, but entries live in one contiguous array of
+ * slots allocated up front, the recency list links slots with 32-bit
+ * indices and the index is an open-addressing (linear probing) table of
+ * slot indices. There is no per-entry heap allocation and no pointer in an
+ * entry, which roughly halves the memory used by small keys and values
+ * and keeps lookups and promotions within a couple of cache lines.
+ *
+ * Limitations: K and V must be default constructible, and 1 <= maxsize < 2^30.
+ *
+ * See http://code.google.com/p/lru-cache-cpp/ for usage and limitations.
+ *
+ * Licensed under the GNU LGPL: http://www.gnu.org/copyleft/lesser.html
+ *
+ */
+
+#ifndef PLB_LRU_FLAT_HPP
+#define PLB_LRU_FLAT_HPP
+
+#include <hashtable.h>
+#include <stdint.h>
+#include <sstream>
+#include <vector>
+#include <cassert>
+
+namespace {
+
+//-------------------------------------------------------------
+// Slot
+//-------------------------------------------------------------
+
+const uint32_t LRU_FLAT_NIL = 0xFFFFFFFF;
+
+template<class K, class V>
+struct LRUCacheFlatSlot
+{
+	LRUCacheFlatSlot()
+		: _key(), _v(), _older(LRU_FLAT_NIL), _newer(LRU_FLAT_NIL) { }
+
+	K _key;
+	V _v;
+	uint32_t _older;
+	uint32_t _newer;
+};
+
+
+//-------------------------------------------------------------
+// Table
+//-------------------------------------------------------------
+
+// Where the recency list ends and how the index is hashed. Plain data, so
+// that SharedLRUCache can keep it in shared memory.
+struct LRUCacheFlatState
+{
+	uint32_t _mask;                           // buckets - 1
+	int _shift;                               // 64 - log2(buckets)
+	uint32_t _size;
+	uint32_t _mru;
+	uint32_t _lru;
+};
+
+
+// The index and recency list of slots linked by number, over storage owned
+// by the cache: LRUCacheFlat keeps it in vectors, SharedLRUCache in shared
+// memory. A table is only a view, made for each operation.
+template<class K, class Slot, class H>
+class LRUCacheFlatTable
+{
+public:
+	LRUCacheFlatTable(LRUCacheFlatState & state, Slot * slots, uint32_t * index)
+		: _state(state), _slots(slots), _index(index) { }
+
+	// The index is a power of two at least twice maxsize: probe sequences
+	// stay short and it never needs to grow
+	static uint32_t buckets(uint32_t maxsize)
+	{
+		uint32_t ret = 2;
+		while (ret < 2 * maxsize)
+			ret <<= 1;
+		return ret;
+	}
+
+	// Pre-condition: the index holds buckets(maxsize) entries
+	void init(uint32_t maxsize)
+	{
+		_state._mask = buckets(maxsize) - 1;
+		_state._shift = 64;
+		for (uint32_t b = 1;  b <= _state._mask;  b <<= 1)
+			--_state._shift;
+		clear();
+	}
+
+	void clear()
+	{
+		_state._size = 0;
+		_state._mru = LRU_FLAT_NIL;
+		_state._lru = LRU_FLAT_NIL;
+		for (uint32_t b = 0;  b <= _state._mask;  ++b)
+			_index[b] = LRU_FLAT_NIL;
+	}
+
+	// Fibonacci hashing: __gnu_cxx::hash is the identity for integers, so
+	// use the high bits of a multiplicative mix rather than the low bits of
+	// the key
+	uint32_t bucket(const K & key) const
+	{
+		uint64_t h = H()(key);
+		return uint32_t((h * 0x9E3779B97F4A7C15ULL) >> _state._shift) & _state._mask;
+	}
+
+	// slot, or LRU_FLAT_NIL
+	uint32_t lookup(const K & key) const
+	{
+		for (uint32_t b = bucket(key);  _index[b] != LRU_FLAT_NIL;  b = (b + 1) & _state._mask) {
+			if (_slots[_index[b]]._key == key)
+				return _index[b];
+		}
+		return LRU_FLAT_NIL;
+	}
+
+	// Backward shift deletion: entries after the hole move back if their
+	// preferred bucket does not lie between the hole and their position, so
+	// lookups never need tombstones
+	void unindex(const K & key)
+	{
+		const uint32_t mask = _state._mask;
+		uint32_t hole = bucket(key);
+		while (!(_slots[_index[hole]]._key == key))
+			hole = (hole + 1) & mask;
+
+		for (uint32_t b = (hole + 1) & mask;  _index[b] != LRU_FLAT_NIL;  b = (b + 1) & mask) {
+			uint32_t home = bucket(_slots[_index[b]]._key);
+			if (((b - home) & mask) >= ((b - hole) & mask)) {
+				_index[hole] = _index[b];
+				hole = b;
+			}
+		}
+		_index[hole] = LRU_FLAT_NIL;
+	}
+
+	// Moves the slot to the MRU position
+	uint32_t update(uint32_t pos)
+	{
+		Slot & s = _slots[pos];
+		if (pos == _state._mru)
+			return pos;
+
+		// "remove" key from current position
+		if (pos == _state._lru)
+			_state._lru = s._newer;
+		else
+			_slots[s._older]._newer = s._newer;
+		_slots[s._newer]._older = s._older;
+
+		// "insert" key to MRU position
+		s._older = _state._mru;
+		s._newer = LRU_FLAT_NIL;
+		_slots[_state._mru]._newer = pos;
+		_state._mru = pos;
+
+		return pos;
+	}
+
+	// Takes a slot for key, the LRU one if size is maxsize, and makes it the
+	// MRU. Its value is left to the caller. Pre-condition: key is not there.
+	uint32_t insert(const K & key, uint32_t maxsize)
+	{
+		uint32_t pos;
+
+		// if we are full, recycle the LRU slot, otherwise take the next free one
+		if (_state._size >= maxsize) {
+			pos = _state._lru;
+			unindex(_slots[pos]._key);
+			_state._lru = _slots[pos]._newer;
+			if (_state._lru != LRU_FLAT_NIL)
+				_slots[_state._lru]._older = LRU_FLAT_NIL;
+			else
+				_state._mru = LRU_FLAT_NIL;
+		}
+		else {
+			pos = _state._size++;
+		}
+
+		Slot & s = _slots[pos];
+		s._key = key;
+
+		uint32_t b = bucket(key);
+		while (_index[b] != LRU_FLAT_NIL)
+			b = (b + 1) & _state._mask;
+		_index[b] = pos;
+
+		// insert key to MRU position
+		s._older = _state._mru;
+		s._newer = LRU_FLAT_NIL;
+		if (_state._mru != LRU_FLAT_NIL)
+			_slots[_state._mru]._newer = pos;
+		_state._mru = pos;
+		if (_state._lru == LRU_FLAT_NIL)
+			_state._lru = pos;
+
+		return pos;
+	}
+
+private:
+	LRUCacheFlatState & _state;
+	Slot * _slots;
+	uint32_t * _index;
+};
+
+
+//-------------------------------------------------------------
+// Const Iterator
+//-------------------------------------------------------------
+
+template<class K, class V>
+class LRUCacheFlatConstIterator
+{
+public:
+	typedef LRUCacheFlatSlot<K, V> Slot;
+	typedef LRUCacheFlatConstIterator<K, V> const_iterator;
+
+	enum DIRECTION {
+		MRU_TO_LRU = 0,
+		LRU_TO_MRU
+	};
+
+	LRUCacheFlatConstIterator(const Slot * slots = NULL, uint32_t pos = LRU_FLAT_NIL, DIRECTION dir = MRU_TO_LRU)
+		: _slots(slots), _pos(pos), _dir(dir) { }
+
+	const_iterator & operator++()
+	{
+		assert(_pos != LRU_FLAT_NIL);
+		_pos = (_dir == MRU_TO_LRU ? _slots[_pos]._older : _slots[_pos]._newer);
+		return *this;
+	}
+
+	const_iterator operator++(int)
+	{
+		const_iterator ret = *this;
+		++*this;
+		return ret;
+	}
+
+	bool operator==(const const_iterator & other) { return _pos == other._pos; }
+	bool operator!=(const const_iterator & other) { return _pos != other._pos; }
+
+	const K & key() const { assert(_pos != LRU_FLAT_NIL); return _slots[_pos]._key; }
+	const V & value() const { assert(_pos != LRU_FLAT_NIL); return _slots[_pos]._v; }
+
+private:
+	const Slot * _slots;
+	uint32_t _pos;
+	DIRECTION _dir;
+};
+
+} // file scope
+
+
+namespace plb {
+
+//-------------------------------------------------------------
+// Flat LRU Cache
+//-------------------------------------------------------------
+
+template<class K, class V>
+class LRUCacheFlat
+{
+public:
+	typedef LRUCacheFlatConstIterator<K, V> const_iterator;
+
+public:
+	LRUCacheFlat(int maxsize);                  // Pre-condition: 1 <= maxsize < 2^30
+
+	V & operator[](const K & key);
+	void insert(const K & key, const V & value);
+
+	int size() const;
+	int maxsize() const;
+	bool empty() const;
+
+	const_iterator find(const K & key);         // updates the MRU
+	const_iterator find(const K & key) const;   // does not update the MRU
+	const_iterator mru_begin() const;           // from MRU to LRU
+	const_iterator lru_begin() const;           // from LRU to MRU
+	const_iterator end() const;
+
+	void dump_mru_to_lru(std::ostream & os) const;
+
+private:
+	typedef LRUCacheFlatSlot<K, V> Slot;
+	typedef LRUCacheFlatTable<K, Slot, __gnu_cxx::hash<K> > Table;
+
+private:
+	Table _table() const;                     // the const methods only look up
+	uint32_t _update_or_insert(const K & key);
+
+private:
+	std::vector<Slot> _slots;
+	std::vector<uint32_t> _index;             // slot numbers, LRU_FLAT_NIL if empty
+	LRUCacheFlatState _state;
+	int _maxsize;
+};
+
+
+template<class K, class V>
+LRUCacheFlat<K, V>::LRUCacheFlat(int maxsize)
+	: _maxsize(maxsize)
+{
+	if (_maxsize <= 0 || _maxsize > 0x3FFFFFFF)
+		throw "LRUCacheFlat: expecting 1 <= cache size < 2^30";
+
+	_slots.resize(_maxsize);
+	_index.resize(Table::buckets(_maxsize));
+	_table().init(_maxsize);
+}
+
+
+template<class K, class V>
+V & LRUCacheFlat<K, V>::operator[](const K & key)
+{
+	return _slots[_update_or_insert(key)]._v;
+}
+
+
+template<class K, class V>
+void LRUCacheFlat<K, V>::insert(const K & key, const V & value)
+{
+	_slots[_update_or_insert(key)]._v = value;
+}
+
+
+template<class K, class V>
+int LRUCacheFlat<K, V>::size() const
+{
+	return _state._size;
+}
+
+
+template<class K, class V>
+int LRUCacheFlat<K, V>::maxsize() const
+{
+	return _maxsize;
+}
+
+
+template<class K, class V>
+bool LRUCacheFlat<K, V>::empty() const
+{
+	return _state._size == 0;
+}
+
+
+// updates MRU
+template<class K, class V>
+typename LRUCacheFlat<K, V>::const_iterator LRUCacheFlat<K, V>::find(const K & key)
+{
+	Table table = _table();
+	uint32_t pos = table.lookup(key);
+	if (pos == LRU_FLAT_NIL)
+		return end();
+	return const_iterator(&_slots[0], table.update(pos), const_iterator::MRU_TO_LRU);
+}
+
+
+// does not update MRU
+template<class K, class V>
+typename LRUCacheFlat<K, V>::const_iterator LRUCacheFlat<K, V>::find(const K & key) const
+{
+	uint32_t pos = _table().lookup(key);
+	if (pos == LRU_FLAT_NIL)
+		return end();
+	return const_iterator(&_slots[0], pos, const_iterator::MRU_TO_LRU);
+}
+
+
+template<class K, class V>
+void LRUCacheFlat<K, V>::dump_mru_to_lru(std::ostream & os) const
+{
+	os << "LRUCacheFlat(" << size() << "/" << maxsize() << "): MRU --> LRU: " << std::endl;
+	for (const_iterator it = mru_begin();  it != end();  ++it)
+		os << it.key() << ": " << it.value() << std::endl;
+}
+
+
+template<class K, class V>
+typename LRUCacheFlat<K, V>::const_iterator LRUCacheFlat<K, V>::mru_begin() const
+{
+	return const_iterator(&_slots[0], _state._mru, const_iterator::MRU_TO_LRU);
+}
+
+
+template<class K, class V>
+typename LRUCacheFlat<K, V>::const_iterator LRUCacheFlat<K, V>::lru_begin() const
+{
+	return const_iterator(&_slots[0], _state._lru, const_iterator::LRU_TO_MRU);
+}
+
+
+template<class K, class V>
+typename LRUCacheFlat<K, V>::const_iterator LRUCacheFlat<K, V>::end() const
+{
+	return const_iterator();
+}
+
+
+template<class K, class V>
+typename LRUCacheFlat<K, V>::Table LRUCacheFlat<K, V>::_table() const
+{
+	return Table(const_cast<LRUCacheFlatState &>(_state), const_cast<Slot *>(&_slots[0]), const_cast<uint32_t *>(&_index[0]));
+}
+
+
+template<class K, class V>
+uint32_t LRUCacheFlat<K, V>::_update_or_insert(const K & key)
+{
+	Table table = _table();
+	uint32_t pos = table.lookup(key);
+	if (pos != LRU_FLAT_NIL)
+		return table.update(pos);
+
+	pos = table.insert(key, _maxsize);
+	_slots[pos]._v = V();
+	return pos;
+}
+
+
+}  // namespace plb
+
+#endif  // PLB_LRU_FLAT_HPP
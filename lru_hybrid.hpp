@@ -0,0 +1,320 @@
+/*
+ * Two-tier LRU cache: an LRUCacheH4 in memory, backed by a log on disk.
+ *
+ * Entries evicted from memory are appended to the current segment file, and
+ * a compact in-memory index maps their keys to their records. A find()
+ * that misses in memory reads the record and promotes the entry back to
+ * memory. Disk writes are only ever appends.
+ *
+ * When the current segment is full, a new one is started; beyond the
+ * maximum number of segments the oldest one is deleted, with whatever
+ * entries it still holds: the disk tier is a FIFO of segments. A promoted
+ * or overwritten entry leaves a dead record behind, reclaimed with its
+ * segment.
+ *
+ * Records are written with LRUCacheH4Serializer (see lru_snapshot.hpp).
+ * The segment files are deleted with the cache: it does not survive a
+ * restart. Not thread-safe.
+ *
+ * See http://code.google.com/p/lru-cache-cpp/ for usage and limitations.
+ *
+ * Licensed under the GNU LGPL: http://www.gnu.org/copyleft/lesser.html
+ *
+ */
+
+#ifndef PLB_LRU_HYBRID_HPP
+#define PLB_LRU_HYBRID_HPP
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <cstdio>
+#include <deque>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "lru.hpp"
+#include "lru_snapshot.hpp"
+
+namespace plb {
+
+//-------------------------------------------------------------
+// Hybrid Cache
+//-------------------------------------------------------------
+
+template<class K, class V>
+class HybridCache
+{
+public:
+	// Pre-condition: maxsize >= 1, segments >= 1. dir must exist.
+	HybridCache(int maxsize, const std::string & dir, unsigned long segment_size = 64 << 20, int segments = 16);
+	~HybridCache();                             // deletes the segment files
+
+	void insert(const K & key, const V & value);
+	bool find(const K & key, V & value);        // promotes a disk hit to memory
+	bool erase(const K & key);
+
+	int size() const;                           // entries in memory
+	int maxsize() const;
+	bool empty() const;
+	int disk_size() const;                      // entries on disk
+	int segments() const;                       // segment files
+	long disk_hits() const;
+
+private:
+	// Where a record lives: segment sequence number, offset and length
+	struct Location
+	{
+		uint32_t _segment;
+		uint32_t _offset;
+		uint32_t _length;
+	};
+
+	struct Segment
+	{
+		uint32_t _seq;
+		int _fd;
+		uint32_t _size;
+		std::vector<K> _keys;                     // of the records it holds, dead or alive
+	};
+
+	typedef LRUCacheH4<K, V> Cache;
+	typedef std::unordered_map<K, Location, LRUCacheH4Hash<K>, LRUCacheH4Equal<K> > Index;
+
+private:
+	HybridCache(const HybridCache & other);
+	HybridCache & operator=(const HybridCache & other);
+
+	void _demote();
+	void _append(const K & key, const V & value);
+	bool _read(const Location & location, V & value);
+	void _open_segment();
+	void _drop_oldest();
+	std::string _path(uint32_t seq) const;
+
+private:
+	Cache _memory;
+	Index _index;
+	std::deque<Segment> _segments;              // oldest first
+	std::string _dir;
+	unsigned long _segment_size;
+	int _max_segments;
+	uint32_t _next_seq;
+	long _disk_hits;
+	std::ostringstream _record;                 // reused to serialize records
+};
+
+
+template<class K, class V>
+HybridCache<K, V>::HybridCache(int maxsize, const std::string & dir, unsigned long segment_size, int segments)
+	: _memory(maxsize),
+	  _dir(dir),
+	  _segment_size(segment_size),
+	  _max_segments(segments),
+	  _next_seq(0),
+	  _disk_hits(0)
+{
+	if (_max_segments <= 0)
+		throw "HybridCache: expecting segments >= 1";
+
+	// evictions are queued, then demoted after each operation
+	_memory.set_listener([](const K &, V &, LRUCacheH4Removal) { }, true);
+	_open_segment();
+}
+
+
+template<class K, class V>
+HybridCache<K, V>::~HybridCache()
+{
+	while (!_segments.empty()) {
+		::close(_segments.front()._fd);
+		std::remove(_path(_segments.front()._seq).c_str());
+		_segments.pop_front();
+	}
+}
+
+
+template<class K, class V>
+void HybridCache<K, V>::insert(const K & key, const V & value)
+{
+	_index.erase(key);
+	_memory.insert(key, value);
+	_demote();
+}
+
+
+template<class K, class V>
+bool HybridCache<K, V>::find(const K & key, V & value)
+{
+	typename Cache::const_iterator it = _memory.find(key);
+	if (it != _memory.end()) {
+		value = it.value();
+		return true;
+	}
+
+	typename Index::iterator location = _index.find(key);
+	if (location == _index.end() || !_read(location->second, value))
+		return false;
+
+	++_disk_hits;
+	_index.erase(location);
+	_memory.insert(key, value);
+	_demote();
+	return true;
+}
+
+
+template<class K, class V>
+bool HybridCache<K, V>::erase(const K & key)
+{
+	bool ret = _index.erase(key) > 0;
+	ret = _memory.erase(key) || ret;
+
+	typename Cache::Removals erased;
+	_memory.take_removals(erased);
+	return ret;
+}
+
+
+template<class K, class V>
+int HybridCache<K, V>::size() const
+{
+	return _memory.size();
+}
+
+
+template<class K, class V>
+int HybridCache<K, V>::maxsize() const
+{
+	return _memory.maxsize();
+}
+
+
+template<class K, class V>
+bool HybridCache<K, V>::empty() const
+{
+	return size() == 0;
+}
+
+
+template<class K, class V>
+int HybridCache<K, V>::disk_size() const
+{
+	return _index.size();
+}
+
+
+template<class K, class V>
+int HybridCache<K, V>::segments() const
+{
+	return _segments.size();
+}
+
+
+template<class K, class V>
+long HybridCache<K, V>::disk_hits() const
+{
+	return _disk_hits;
+}
+
+
+// Only evictions go to disk: replaced values are stale, erased ones
+// unwanted and expired ones dead
+template<class K, class V>
+void HybridCache<K, V>::_demote()
+{
+	typename Cache::Removals removed;
+	_memory.take_removals(removed);
+	for (size_t i = 0;  i < removed.size();  ++i) {
+		if (removed[i]._cause == LRU_EVICTED)
+			_append(removed[i]._key, removed[i]._v);
+	}
+}
+
+
+// Record: its length, then the key and the value
+template<class K, class V>
+void HybridCache<K, V>::_append(const K & key, const V & value)
+{
+	_record.str(std::string());
+	_record.write("\0\0\0\0", sizeof(uint32_t));
+	LRUCacheH4Serializer<K>::write(_record, key);
+	LRUCacheH4Serializer<V>::write(_record, value);
+	std::string record = _record.str();
+	const uint32_t length = record.size();
+	record.replace(0, sizeof(length), reinterpret_cast<const char *>(&length), sizeof(length));
+
+	if (_segments.back()._size > 0 && _segments.back()._size + length > _segment_size)
+		_open_segment();
+
+	Segment & segment = _segments.back();
+	if (::pwrite(segment._fd, record.data(), length, segment._size) != ssize_t(length))
+		throw "HybridCache: segment write failed";
+
+	Location location = { segment._seq, segment._size, length };
+	_index[key] = location;
+	segment._keys.push_back(key);
+	segment._size += length;
+}
+
+
+template<class K, class V>
+bool HybridCache<K, V>::_read(const Location & location, V & value)
+{
+	const Segment & segment = _segments[location._segment - _segments.front()._seq];
+	std::vector<char> record(location._length);
+	if (::pread(segment._fd, &record[0], location._length, location._offset) != ssize_t(location._length))
+		return false;
+
+	const char * end = &record[0] + location._length;
+	K key;
+	const char * pos = LRUCacheH4Serializer<K>::read(&record[0] + sizeof(uint32_t), end, key);
+	return pos && LRUCacheH4Serializer<V>::read(pos, end, value);
+}
+
+
+template<class K, class V>
+void HybridCache<K, V>::_open_segment()
+{
+	if (int(_segments.size()) >= _max_segments)
+		_drop_oldest();
+
+	Segment segment;
+	segment._seq = _next_seq++;
+	segment._size = 0;
+	segment._fd = ::open(_path(segment._seq).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (segment._fd < 0)
+		throw "HybridCache: cannot create segment file";
+	_segments.push_back(segment);
+}
+
+
+// The index entries still pointing into the segment go with it
+template<class K, class V>
+void HybridCache<K, V>::_drop_oldest()
+{
+	Segment & oldest = _segments.front();
+	for (size_t i = 0;  i < oldest._keys.size();  ++i) {
+		typename Index::iterator it = _index.find(oldest._keys[i]);
+		if (it != _index.end() && it->second._segment == oldest._seq)
+			_index.erase(it);
+	}
+	::close(oldest._fd);
+	std::remove(_path(oldest._seq).c_str());
+	_segments.pop_front();
+}
+
+
+template<class K, class V>
+std::string HybridCache<K, V>::_path(uint32_t seq) const
+{
+	std::ostringstream os;
+	os << _dir << "/segment." << seq;
+	return os.str();
+}
+
+
+}  // namespace plb
+
+#endif  // PLB_LRU_HYBRID_HPP
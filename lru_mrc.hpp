@@ -0,0 +1,234 @@
+/*
+ * Online estimation of the hit ratio of an LRU cache, for a range of sizes.
+ *
+ * Feed it the keys a cache is accessed with: it estimates the hit ratio
+ * that an LRU cache of any size up to max_size would get on them, which
+ * tells how large the cache should be.
+ *
+ * Only the keys whose hash falls under a threshold are tracked, a fraction
+ * rate of them (spatial sampling): a sampled key has all of its accesses
+ * sampled, and the reuse distances measured among the sampled keys, scaled
+ * by 1 / rate, estimate those of the whole stream. An access to a key that
+ * is not sampled costs one hash and a comparison, so that the estimator can
+ * stay on in production. Memory is proportional to the sampled keys. The
+ * sample must keep enough keys for the sizes of interest: 0.01 suits a few
+ * million keys, 0.001 tens of millions. Not thread-safe.
+ *
+ * The reuse distance of an access, the number of distinct keys accessed
+ * since the previous access to the same key, is the smallest LRU cache
+ * that hits. It is counted with a Fenwick tree over the sampled accesses,
+ * marking the last access to each key, in O(log n).
+ *
+ * Reference: C. Waldspurger, N. Park, A. Garthwaite, I. Ahmad, "Efficient
+ * MRC Construction with SHARDS", FAST 2015.
+ *
+ * See http://code.google.com/p/lru-cache-cpp/ for usage and limitations.
+ *
+ * Licensed under the GNU LGPL: http://www.gnu.org/copyleft/lesser.html
+ *
+ */
+
+#ifndef PLB_LRU_MRC_HPP
+#define PLB_LRU_MRC_HPP
+
+#include <stdint.h>
+#include <algorithm>
+#include <ostream>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "lru.hpp"
+
+namespace plb {
+
+//-------------------------------------------------------------
+// Miss Ratio Curve
+//-------------------------------------------------------------
+
+template<class K>
+class MissRatioCurve
+{
+public:
+	// Pre-condition: 0 < rate <= 1, max_size >= steps >= 1. Hit ratios are
+	// estimated for sizes that are multiples of max_size / steps.
+	MissRatioCurve(double rate, int max_size, int steps = 100);
+
+	void access(const K & key);
+
+	double hit_ratio(int cache_size) const;     // estimated for an LRU cache of that size
+	long accesses() const;
+	long samples() const;                       // sampled accesses
+	int sampled_keys() const;
+	double rate() const;
+
+	void dump(std::ostream & os) const;         // the hit ratio for each step
+
+private:
+	typedef std::unordered_map<K, uint32_t, LRUCacheH4Hash<K>, LRUCacheH4Equal<K> > LastAccess;
+
+	enum { HASH_BITS = 24 };
+
+private:
+	void _mark(uint32_t time, int delta);
+	int _marked_up_to(uint32_t time) const;
+	void _renumber();
+
+private:
+	uint64_t _threshold;                        // keys whose hash bits fall below are sampled
+	double _rate;
+	int _step;
+	LastAccess _last;                           // sampled key -> time of its last access
+	std::vector<int> _tree;                     // Fenwick tree over times, 1-based
+	uint32_t _now;
+	std::vector<long> _histogram;               // scaled reuse distances, by step; the last: beyond
+	long _accesses;
+	long _samples;
+};
+
+
+template<class K>
+MissRatioCurve<K>::MissRatioCurve(double rate, int max_size, int steps)
+	: _threshold(uint64_t(rate * (1 << HASH_BITS))),
+	  _rate(rate),
+	  _step(steps > 0 ? std::max(max_size / steps, 1) : 1),
+	  _tree(1025, 0),
+	  _now(0),
+	  _histogram(steps > 0 ? steps + 1 : 1, 0),
+	  _accesses(0),
+	  _samples(0)
+{
+	if (rate <= 0.0 || rate > 1.0 || steps <= 0 || max_size < steps)
+		throw "MissRatioCurve: expecting 0 < rate <= 1 and max_size >= steps >= 1";
+	if (_threshold == 0)
+		_threshold = 1;
+}
+
+
+// The sampling hash takes bits the index of LRUCacheH4 does not use, so
+// that the sampled keys are spread over its buckets
+template<class K>
+void MissRatioCurve<K>::access(const K & key)
+{
+	++_accesses;
+	uint64_t h = uint64_t(LRUCacheH4Hash<K>()(key)) * 0x9E3779B97F4A7C15ULL;
+	if (((h >> 16) & ((1 << HASH_BITS) - 1)) >= _threshold)
+		return;
+
+	++_samples;
+	if (_now + 1 >= _tree.size())
+		_renumber();
+	const uint32_t now = ++_now;
+
+	typename LastAccess::iterator last = _last.find(key);
+	if (last == _last.end()) {
+		_last.insert(std::make_pair(key, now));
+		_histogram.back() += 1;                   // a cold miss misses in any cache
+	}
+	else {
+		// every key has one mark, none after now: those after then are the distance
+		const uint32_t then = last->second;
+		const int distance = int(_last.size()) - _marked_up_to(then);
+		const size_t step = size_t(distance / _rate) / _step;
+		_histogram[std::min(step, _histogram.size() - 1)] += 1;
+		_mark(then, -1);
+		last->second = now;
+	}
+	_mark(now, 1);
+}
+
+
+// A cache of size s hits the accesses at a distance of less than s
+template<class K>
+double MissRatioCurve<K>::hit_ratio(int cache_size) const
+{
+	if (_samples == 0)
+		return 0.0;
+
+	long hits = 0;
+	for (size_t i = 0;  i + 1 < _histogram.size() && long(i + 1) * _step <= cache_size;  ++i)
+		hits += _histogram[i];
+	return double(hits) / _samples;
+}
+
+
+template<class K>
+long MissRatioCurve<K>::accesses() const
+{
+	return _accesses;
+}
+
+
+template<class K>
+long MissRatioCurve<K>::samples() const
+{
+	return _samples;
+}
+
+
+template<class K>
+int MissRatioCurve<K>::sampled_keys() const
+{
+	return _last.size();
+}
+
+
+template<class K>
+double MissRatioCurve<K>::rate() const
+{
+	return _rate;
+}
+
+
+template<class K>
+void MissRatioCurve<K>::dump(std::ostream & os) const
+{
+	os << "MissRatioCurve(rate " << _rate << ", " << _samples << "/" << _accesses << " accesses sampled, "
+	   << _last.size() << " keys): size: hit ratio" << std::endl;
+	for (size_t i = 1;  i < _histogram.size();  ++i)
+		os << i * _step << ": " << hit_ratio(i * _step) << std::endl;
+}
+
+
+template<class K>
+void MissRatioCurve<K>::_mark(uint32_t time, int delta)
+{
+	for (;  time < _tree.size();  time += time & -time)
+		_tree[time] += delta;
+}
+
+
+template<class K>
+int MissRatioCurve<K>::_marked_up_to(uint32_t time) const
+{
+	int ret = 0;
+	for (;  time > 0;  time -= time & -time)
+		ret += _tree[time];
+	return ret;
+}
+
+
+// Times run out: the keys are renumbered 1 to n in the order of their last
+// access, and the tree rebuilt with room for as many accesses again
+template<class K>
+void MissRatioCurve<K>::_renumber()
+{
+	std::vector<std::pair<uint32_t, typename LastAccess::iterator> > order;
+	order.reserve(_last.size());
+	for (typename LastAccess::iterator it = _last.begin();  it != _last.end();  ++it)
+		order.push_back(std::make_pair(it->second, it));
+	std::sort(order.begin(), order.end(),
+	          [](const std::pair<uint32_t, typename LastAccess::iterator> & a,
+	             const std::pair<uint32_t, typename LastAccess::iterator> & b) { return a.first < b.first; });
+
+	_tree.assign(std::max<size_t>(2 * order.size(), 1024) + 1, 0);
+	for (size_t i = 0;  i < order.size();  ++i) {
+		order[i].second->second = i + 1;
+		_mark(i + 1, 1);
+	}
+	_now = order.size();
+}
+
+
+}  // namespace plb
+
+#endif  // PLB_LRU_MRC_HPP
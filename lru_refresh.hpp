@@ -0,0 +1,263 @@
+/*
+ * Thread-safe LRU cache with refresh-ahead of expiring entries.
+ *
+ * Entries are loaded by a loader function and expire ttl ticks after they
+ * were loaded. A hit on an entry that expires within the refresh window
+ * returns the current value at once and queues the key for a background
+ * reload by a small pool of worker threads: an entry that keeps being read
+ * is replaced before it expires, and its readers never wait for the loader.
+ * Only a miss, or an entry that was not read during its window, loads
+ * inline.
+ *
+ * A failed reload (the loader throws) leaves the current value in place, to
+ * expire normally.
+ *
+ * See http://code.google.com/p/lru-cache-cpp/ for usage and limitations.
+ *
+ * Licensed under the GNU LGPL: http://www.gnu.org/copyleft/lesser.html
+ *
+ */
+
+#ifndef PLB_LRU_REFRESH_HPP
+#define PLB_LRU_REFRESH_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "lru.hpp"
+
+namespace plb {
+
+//-------------------------------------------------------------
+// Refresh-Ahead Cache
+//-------------------------------------------------------------
+
+template<class K, class V>
+class RefreshAheadCache
+{
+public:
+	typedef std::function<V (const K &)> Loader;
+	typedef typename LRUCacheH4<K, V>::Clock Clock;
+
+public:
+	// Pre-condition: maxsize >= 1, ttl >= 1, window < ttl, workers >= 1
+	RefreshAheadCache(int maxsize, unsigned int ttl, unsigned int window, const Loader & loader, int workers = 2);
+	~RefreshAheadCache();                       // waits for the reloads in progress
+
+	// Values are returned by copy: a reference would outlive the lock
+	V get(const K & key);                       // loads inline on a miss only
+	void insert(const K & key, const V & value);
+	bool find(const K & key, V & value);        // never loads, nor schedules a reload
+
+	int size() const;
+	int maxsize() const;
+	bool empty() const;
+	unsigned int ttl() const;
+	unsigned int window() const;
+	int pending() const;                        // keys waiting for or being reloaded
+	long refreshes() const;                     // reloads completed so far
+
+	void set_clock(Clock clock);                // Pre-condition: the cache is empty
+
+private:
+	typedef std::lock_guard<std::mutex> Lock;
+	typedef std::unordered_set<K, LRUCacheH4Hash<K>, LRUCacheH4Equal<K> > KeySet;
+
+private:
+	RefreshAheadCache(const RefreshAheadCache & other);
+	RefreshAheadCache & operator=(const RefreshAheadCache & other);
+
+	void _work();
+
+private:
+	mutable std::mutex _mutex;
+	LRUCacheH4<K, V> _cache;
+	Loader _loader;
+	unsigned int _window;
+
+	// keys are queued once: _queued holds them until their reload is done
+	std::deque<K> _queue;
+	KeySet _queued;
+	long _refreshes;
+
+	std::condition_variable _wake;
+	std::vector<std::thread> _workers;
+	bool _stop;
+};
+
+
+template<class K, class V>
+RefreshAheadCache<K, V>::RefreshAheadCache(int maxsize, unsigned int ttl, unsigned int window, const Loader & loader, int workers)
+	: _cache(maxsize),
+	  _loader(loader),
+	  _window(window),
+	  _refreshes(0),
+	  _stop(false)
+{
+	if (ttl == 0 || window >= ttl)
+		throw "RefreshAheadCache: expecting ttl > window";
+	if (workers <= 0)
+		throw "RefreshAheadCache: expecting workers >= 1";
+
+	_cache.set_default_ttl(ttl);
+	for (int i = 0;  i < workers;  ++i)
+		_workers.push_back(std::thread(&RefreshAheadCache::_work, this));
+}
+
+
+template<class K, class V>
+RefreshAheadCache<K, V>::~RefreshAheadCache()
+{
+	{
+		Lock lock(_mutex);
+		_stop = true;
+	}
+	_wake.notify_all();
+	for (size_t i = 0;  i < _workers.size();  ++i)
+		_workers[i].join();
+}
+
+
+template<class K, class V>
+V RefreshAheadCache<K, V>::get(const K & key)
+{
+	{
+		Lock lock(_mutex);
+		typename LRUCacheH4<K, V>::const_iterator it = _cache.find(key);
+		if (it != _cache.end()) {
+			if (_cache.ttl(key) <= _window && _queued.insert(key).second) {
+				_queue.push_back(key);
+				_wake.notify_one();
+			}
+			return it.value();
+		}
+	}
+
+	V value = _loader(key);
+	insert(key, value);
+	return value;
+}
+
+
+template<class K, class V>
+void RefreshAheadCache<K, V>::insert(const K & key, const V & value)
+{
+	Lock lock(_mutex);
+	_cache.insert(key, value);
+}
+
+
+template<class K, class V>
+bool RefreshAheadCache<K, V>::find(const K & key, V & value)
+{
+	Lock lock(_mutex);
+	typename LRUCacheH4<K, V>::const_iterator it = _cache.find(key);
+	if (it == _cache.end())
+		return false;
+	value = it.value();
+	return true;
+}
+
+
+template<class K, class V>
+int RefreshAheadCache<K, V>::size() const
+{
+	Lock lock(_mutex);
+	return _cache.size();
+}
+
+
+template<class K, class V>
+int RefreshAheadCache<K, V>::maxsize() const
+{
+	return _cache.maxsize();
+}
+
+
+template<class K, class V>
+bool RefreshAheadCache<K, V>::empty() const
+{
+	return size() == 0;
+}
+
+
+template<class K, class V>
+unsigned int RefreshAheadCache<K, V>::ttl() const
+{
+	return _cache.default_ttl();
+}
+
+
+template<class K, class V>
+unsigned int RefreshAheadCache<K, V>::window() const
+{
+	return _window;
+}
+
+
+template<class K, class V>
+int RefreshAheadCache<K, V>::pending() const
+{
+	Lock lock(_mutex);
+	return _queued.size();
+}
+
+
+template<class K, class V>
+long RefreshAheadCache<K, V>::refreshes() const
+{
+	Lock lock(_mutex);
+	return _refreshes;
+}
+
+
+template<class K, class V>
+void RefreshAheadCache<K, V>::set_clock(Clock clock)
+{
+	Lock lock(_mutex);
+	_cache.set_clock(clock);
+}
+
+
+// Worker loop: the loader runs without the lock. An entry evicted while it
+// was being reloaded is not brought back.
+template<class K, class V>
+void RefreshAheadCache<K, V>::_work()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	for (;;) {
+		while (_queue.empty() && !_stop)
+			_wake.wait(lock);
+		if (_stop)
+			return;
+
+		K key = _queue.front();
+		_queue.pop_front();
+		lock.unlock();
+
+		bool loaded = false;
+		V value;
+		try {
+			value = _loader(key);
+			loaded = true;
+		}
+		catch (...) {
+		}
+
+		lock.lock();
+		if (loaded && _cache.contains(key)) {
+			_cache.insert(key, value);
+			++_refreshes;
+		}
+		_queued.erase(key);
+	}
+}
+
+
+}  // namespace plb
+
+#endif  // PLB_LRU_REFRESH_HPP
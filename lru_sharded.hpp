@@ -0,0 +1,392 @@
+/*
+ * Thread-safe front-end to LRUCacheH4: keys are hashed to N independent
+ * shards, each one an LRUCacheH4 protected by its own lock.
+ *
+ * Each shard evicts on its own, so the cache as a whole is only an
+ * approximation of a global LRU: a shard evicts its own LRU entry even if
+ * an older entry lives in another shard.
+ *
+ * get_or_load() coalesces concurrent misses: while a key is being loaded,
+ * other callers for it wait for that load instead of starting their own.
+ *
+ * set_maxsize() re-splits the capacity over the shards: each shard applies
+ * its share in bounded steps, on the operations that follow.
+ *
+ * The removal listener runs after the shard lock is released, on the thread
+ * whose operation removed the values: it may use the cache, must not throw,
+ * and the values are destroyed outside the lock.
+ *
+ * See http://code.google.com/p/lru-cache-cpp/ for usage and limitations.
+ *
+ * Licensed under the GNU LGPL: http://www.gnu.org/copyleft/lesser.html
+ *
+ */
+
+#ifndef PLB_LRU_SHARDED_HPP
+#define PLB_LRU_SHARDED_HPP
+
+#include <atomic>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "lru.hpp"
+
+namespace plb {
+
+//-------------------------------------------------------------
+// Sharded LRU Cache
+//-------------------------------------------------------------
+
+template<class K, class V>
+class LRUCacheH4Sharded
+{
+public:
+	typedef typename LRUCacheH4<K, V>::Listener Listener;
+
+public:
+	LRUCacheH4Sharded(int maxsize, int shards = 16);   // Pre-condition: maxsize >= shards >= 1
+	~LRUCacheH4Sharded();
+
+	// Values are returned by copy: a reference would outlive the shard lock
+	V operator[](const K & key);
+	void insert(const K & key, const V & value);
+
+	bool find(const K & key, V & value);          // updates the MRU of the shard
+	bool find(const K & key, V & value) const;    // does not update the MRU
+
+	// On a miss, the first caller runs loader(key) outside the shard lock and
+	// caches the result; concurrent callers for the key wait for it. An
+	// exception thrown by the loader is rethrown to all of them, not cached.
+	template<class F> V get_or_load(const K & key, F loader);
+
+	int size() const;                             // sum of the shard sizes
+	int maxsize() const;
+	bool empty() const;
+
+	void set_maxsize(int maxsize);                // Pre-condition: maxsize >= shards
+
+	// Pre-condition: the cache is not in use by other threads
+	void set_listener(const Listener & listener);
+
+	int shards() const;
+	int shard_of(const K & key) const;
+	int shard_size(int shard) const;
+	int shard_maxsize(int shard) const;
+
+	void dump_mru_to_lru(std::ostream & os) const;
+
+	LRUCacheH4Stats stats() const;              // the sum of the shard counters
+	void dump_stats(std::ostream & os) const;   // per shard, then in total
+
+private:
+	typedef LRUCacheH4<K, V> Cache;
+	typedef std::lock_guard<std::mutex> Lock;
+	typedef std::unique_lock<std::mutex> UniqueLock;
+	typedef typename Cache::Removals Removals;
+	typedef std::unordered_map<K, std::shared_future<V>, LRUCacheH4Hash<K>, LRUCacheH4Equal<K> > Loads;
+
+	// One shard per cache line so that neighbouring locks do not false-share
+	struct alignas(64) Shard
+	{
+		Shard(int maxsize) : _cache(maxsize) { }
+
+		mutable std::mutex _mutex;
+		Cache _cache;
+		Loads _loads;                             // keys being loaded
+	};
+
+private:
+	LRUCacheH4Sharded(const LRUCacheH4Sharded & other);
+	LRUCacheH4Sharded & operator=(const LRUCacheH4Sharded & other);
+
+	Shard & _shard(const K & key) const;
+	void _deliver(Removals & removals) const;
+
+private:
+	std::vector<Shard *> _shards;
+	std::atomic<int> _maxsize;
+	Listener _listener;
+};
+
+
+// The capacity is split evenly, the first shards absorbing the remainder
+template<class K, class V>
+LRUCacheH4Sharded<K, V>::LRUCacheH4Sharded(int maxsize, int shards)
+	: _maxsize(maxsize)
+{
+	if (shards <= 0 || maxsize < shards)
+		throw "LRUCacheH4Sharded: expecting cache size >= shards >= 1";
+
+	_shards.reserve(shards);
+	for (int i = 0;  i < shards;  ++i)
+		_shards.push_back(new Shard(maxsize / shards + (i < maxsize % shards ? 1 : 0)));
+}
+
+
+template<class K, class V>
+LRUCacheH4Sharded<K, V>::~LRUCacheH4Sharded()
+{
+	for (int i = 0;  i < shards();  ++i)
+		delete _shards[i];
+}
+
+
+template<class K, class V>
+V LRUCacheH4Sharded<K, V>::operator[](const K & key)
+{
+	Shard & s = _shard(key);
+	Removals removed;
+	UniqueLock lock(s._mutex);
+	V ret = s._cache[key];
+	s._cache.take_removals(removed);
+	lock.unlock();
+	_deliver(removed);
+	return ret;
+}
+
+
+template<class K, class V>
+void LRUCacheH4Sharded<K, V>::insert(const K & key, const V & value)
+{
+	Shard & s = _shard(key);
+	Removals removed;
+	UniqueLock lock(s._mutex);
+	s._cache.insert(key, value);
+	s._cache.take_removals(removed);
+	lock.unlock();
+	_deliver(removed);
+}
+
+
+// updates MRU; a lookup may expire entries, or evict them for a shrink
+template<class K, class V>
+bool LRUCacheH4Sharded<K, V>::find(const K & key, V & value)
+{
+	Shard & s = _shard(key);
+	Removals removed;
+	UniqueLock lock(s._mutex);
+	typename Cache::const_iterator it = s._cache.find(key);
+	const bool ret = it != s._cache.end();
+	if (ret)
+		value = it.value();
+	s._cache.take_removals(removed);
+	lock.unlock();
+	_deliver(removed);
+	return ret;
+}
+
+
+// does not update MRU
+template<class K, class V>
+bool LRUCacheH4Sharded<K, V>::find(const K & key, V & value) const
+{
+	const Shard & s = _shard(key);
+	Lock lock(s._mutex);
+	typename Cache::const_iterator it = static_cast<const Cache &>(s._cache).find(key);
+	if (it == s._cache.end())
+		return false;
+	value = it.value();
+	return true;
+}
+
+
+// The result is cached and the load forgotten under the same lock, so a
+// caller either joins the load or finds its result in the cache
+template<class K, class V>
+template<class F>
+V LRUCacheH4Sharded<K, V>::get_or_load(const K & key, F loader)
+{
+	Shard & s = _shard(key);
+	std::promise<V> promise;
+	std::shared_future<V> pending;
+	{
+		Lock lock(s._mutex);
+		typename Cache::const_iterator it = s._cache.find(key);
+		if (it != s._cache.end())
+			return it.value();
+
+		typename Loads::const_iterator load = s._loads.find(key);
+		if (load != s._loads.end())
+			pending = load->second;
+		else
+			s._loads.insert(std::make_pair(key, promise.get_future().share()));
+	}
+
+	if (pending.valid())
+		return pending.get();
+
+	try {
+		V value = loader(key);
+		Removals removed;
+		UniqueLock lock(s._mutex);
+		s._cache.insert(key, value);
+		s._cache.take_removals(removed);
+		s._loads.erase(key);
+		promise.set_value(value);
+		lock.unlock();
+		_deliver(removed);
+		return value;
+	}
+	catch (...) {
+		{
+			Lock lock(s._mutex);
+			s._loads.erase(key);
+		}
+		promise.set_exception(std::current_exception());
+		throw;
+	}
+}
+
+
+template<class K, class V>
+int LRUCacheH4Sharded<K, V>::size() const
+{
+	int ret = 0;
+	for (int i = 0;  i < shards();  ++i)
+		ret += shard_size(i);
+	return ret;
+}
+
+
+template<class K, class V>
+int LRUCacheH4Sharded<K, V>::maxsize() const
+{
+	return _maxsize;
+}
+
+
+template<class K, class V>
+bool LRUCacheH4Sharded<K, V>::empty() const
+{
+	return size() == 0;
+}
+
+
+// Split as by the constructor
+template<class K, class V>
+void LRUCacheH4Sharded<K, V>::set_maxsize(int maxsize)
+{
+	if (maxsize < shards())
+		throw "LRUCacheH4Sharded: expecting cache size >= shards >= 1";
+
+	_maxsize = maxsize;
+	for (int i = 0;  i < shards();  ++i) {
+		Shard & s = *_shards[i];
+		Removals removed;
+		UniqueLock lock(s._mutex);
+		s._cache.set_maxsize(maxsize / shards() + (i < maxsize % shards() ? 1 : 0));
+		s._cache.take_removals(removed);
+		lock.unlock();
+		_deliver(removed);
+	}
+}
+
+
+template<class K, class V>
+void LRUCacheH4Sharded<K, V>::set_listener(const Listener & listener)
+{
+	_listener = listener;
+	for (int i = 0;  i < shards();  ++i) {
+		Lock lock(_shards[i]->_mutex);
+		_shards[i]->_cache.set_listener(listener, true);
+	}
+}
+
+
+template<class K, class V>
+int LRUCacheH4Sharded<K, V>::shards() const
+{
+	return _shards.size();
+}
+
+
+// The shard's own index takes the top bits of the same multiplicative mix:
+// pick the shard from the bits just above the middle, which it never uses
+template<class K, class V>
+int LRUCacheH4Sharded<K, V>::shard_of(const K & key) const
+{
+	unsigned long long h = LRUCacheH4Hash<K>()(key);
+	return ((h * 0x9E3779B97F4A7C15ULL) >> 32) % _shards.size();
+}
+
+
+template<class K, class V>
+int LRUCacheH4Sharded<K, V>::shard_size(int shard) const
+{
+	const Shard & s = *_shards[shard];
+	Lock lock(s._mutex);
+	return s._cache.size();
+}
+
+
+template<class K, class V>
+int LRUCacheH4Sharded<K, V>::shard_maxsize(int shard) const
+{
+	const Shard & s = *_shards[shard];
+	Lock lock(s._mutex);
+	return s._cache.maxsize();
+}
+
+
+template<class K, class V>
+void LRUCacheH4Sharded<K, V>::dump_mru_to_lru(std::ostream & os) const
+{
+	os << "LRUCacheH4Sharded(" << shards() << " shards)" << std::endl;
+	for (int i = 0;  i < shards();  ++i) {
+		const Shard & s = *_shards[i];
+		Lock lock(s._mutex);
+		s._cache.dump_mru_to_lru(os);
+	}
+}
+
+
+// Each shard counts under its own lock, on its own cache line: reading
+// takes the locks one after the other
+template<class K, class V>
+LRUCacheH4Stats LRUCacheH4Sharded<K, V>::stats() const
+{
+	LRUCacheH4Stats ret;
+	for (int i = 0;  i < shards();  ++i) {
+		const Shard & s = *_shards[i];
+		Lock lock(s._mutex);
+		ret += s._cache.stats();
+	}
+	return ret;
+}
+
+
+template<class K, class V>
+void LRUCacheH4Sharded<K, V>::dump_stats(std::ostream & os) const
+{
+	os << "LRUCacheH4Sharded(" << shards() << " shards)" << std::endl;
+	for (int i = 0;  i < shards();  ++i) {
+		const Shard & s = *_shards[i];
+		Lock lock(s._mutex);
+		os << "shard " << i << ": ";
+		s._cache.dump_stats(os);
+	}
+	os << "total: " << stats() << std::endl;
+}
+
+
+template<class K, class V>
+typename LRUCacheH4Sharded<K, V>::Shard & LRUCacheH4Sharded<K, V>::_shard(const K & key) const
+{
+	return *_shards[shard_of(key)];
+}
+
+
+// Pre-condition: no shard lock held
+template<class K, class V>
+void LRUCacheH4Sharded<K, V>::_deliver(Removals & removals) const
+{
+	for (size_t i = 0;  i < removals.size();  ++i)
+		_listener(removals[i]._key, removals[i]._v, removals[i]._cause);
+}
+
+
+}  // namespace plb
+
+#endif  // PLB_LRU_SHARDED_HPP
@@ -0,0 +1,353 @@
+/*
+ * LRU cache in POSIX shared memory, shared by the processes of a host.
+ *
+ * The layout is that of LRUCacheFlat, in a single shm_open() region: a
+ * header, maxsize slots whose recency list is linked by 32-bit slot
+ * numbers, and a linear probing index of slot numbers. There is no pointer
+ * anywhere, so each process may map the region at a different address.
+ * The index and the list are those of LRUCacheFlat (LRUCacheFlatTable).
+ *
+ * Every operation takes a process-shared, robust mutex kept in the header.
+ * If a process dies while holding it, the next one to lock it empties the
+ * cache, which may have been left half-updated. A process that opens the
+ * cache while another creates it waits for it to be initialized, up to a
+ * timeout: if the creator died first, the cache must be remove()d.
+ *
+ * Limitations: K and V must be trivially copyable, and hash the same way
+ * in every process (LRUCacheH4Hash does for integers). All processes must
+ * use the same K, V and maxsize, which are checked on opening.
+ *
+ * See http://code.google.com/p/lru-cache-cpp/ for usage and limitations.
+ *
+ * Licensed under the GNU LGPL: http://www.gnu.org/copyleft/lesser.html
+ *
+ */
+
+#ifndef PLB_LRU_SHM_HPP
+#define PLB_LRU_SHM_HPP
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include "lru.hpp"
+#include "lru_flat.hpp"
+
+namespace plb {
+
+//-------------------------------------------------------------
+// Shared Memory LRU Cache
+//-------------------------------------------------------------
+
+template<class K, class V>
+class SharedLRUCache
+{
+public:
+	// Opens the cache called name ("/name" for shm_open), creating it if needed,
+	// waiting up to timeout milliseconds for its creator to initialize it.
+	// Pre-condition: 1 <= maxsize < 2^30.
+	SharedLRUCache(const std::string & name, int maxsize, unsigned int timeout = 5000);
+	~SharedLRUCache();                          // unmaps; the cache lives on until remove()
+
+	static void remove(const std::string & name);
+
+	void insert(const K & key, const V & value);
+	bool find(const K & key, V & value);        // updates the MRU
+	bool contains(const K & key) const;         // does not update the MRU
+
+	int size() const;
+	int maxsize() const;
+	bool empty() const;
+
+	void dump_mru_to_lru(std::ostream & os) const;
+
+private:
+	static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+	              "SharedLRUCache: K and V must be trivially copyable");
+
+	static const uint32_t NIL = LRU_FLAT_NIL;
+	static const uint64_t MAGIC = 0x504C424C52555348ULL;    // "PLBLRUSH"
+
+	typedef LRUCacheFlatSlot<K, V> Slot;                     // never constructed: the region is zero-filled
+	typedef LRUCacheFlatTable<K, Slot, LRUCacheH4Hash<K> > Table;
+
+	// _magic is written last by the creator: the others wait for it
+	struct Header
+	{
+		std::atomic<uint64_t> _magic;
+		uint32_t _key_size;
+		uint32_t _value_size;
+		uint32_t _maxsize;
+		LRUCacheFlatState _state;
+		pthread_mutex_t _mutex;
+	};
+
+	class Lock
+	{
+	public:
+		Lock(const SharedLRUCache & cache);
+		~Lock();
+
+	private:
+		const SharedLRUCache & _cache;
+	};
+
+private:
+	SharedLRUCache(const SharedLRUCache & other);
+	SharedLRUCache & operator=(const SharedLRUCache & other);
+
+	static size_t _length(int maxsize);
+
+	void _init(int maxsize);
+	void _reset() const;
+	Table _table() const;
+	void _close(const char * error);            // unmaps, then throws error
+
+private:
+	void * _region;
+	size_t _length_mapped;
+	Header * _header;
+	Slot * _slots;
+	uint32_t * _index;
+};
+
+
+// Header, slots, index: the slots start on a cache line
+template<class K, class V>
+size_t SharedLRUCache<K, V>::_length(int maxsize)
+{
+	return 64 * ((sizeof(Header) + 63) / 64) + sizeof(Slot) * maxsize + sizeof(uint32_t) * Table::buckets(maxsize);
+}
+
+
+// The creator sizes and initializes the region; a process that loses the
+// race to create it waits for the size, then for the magic number. The
+// creator may have died in between: the wait is bounded.
+template<class K, class V>
+SharedLRUCache<K, V>::SharedLRUCache(const std::string & name, int maxsize, unsigned int timeout)
+	: _region(MAP_FAILED),
+	  _length_mapped(0),
+	  _header(NULL),
+	  _slots(NULL),
+	  _index(NULL)
+{
+	if (maxsize <= 0 || maxsize > 0x3FFFFFFF)
+		throw "SharedLRUCache: expecting 1 <= cache size < 2^30";
+
+	const std::string path = "/" + name;
+	const size_t length = _length(maxsize);
+	const std::chrono::steady_clock::time_point deadline
+		= std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+	bool creator = true;
+	int fd = ::shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 && errno == EEXIST) {
+		creator = false;
+		fd = ::shm_open(path.c_str(), O_RDWR, 0600);
+	}
+	if (fd < 0)
+		throw "SharedLRUCache: cannot open shared memory";
+
+	if (creator && ::ftruncate(fd, length) != 0) {
+		::close(fd);
+		::shm_unlink(path.c_str());
+		throw "SharedLRUCache: cannot size shared memory";
+	}
+	if (!creator) {
+		struct stat st;
+		while (::fstat(fd, &st) == 0 && st.st_size == 0 && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::yield();
+		if (st.st_size == 0) {
+			::close(fd);
+			throw "SharedLRUCache: timed out waiting for the creator; remove() the cache if it died";
+		}
+		if (size_t(st.st_size) != length) {
+			::close(fd);
+			throw "SharedLRUCache: existing cache has another size";
+		}
+	}
+
+	_region = ::mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (_region == MAP_FAILED)
+		throw "SharedLRUCache: cannot map shared memory";
+	_length_mapped = length;
+
+	char * base = static_cast<char *>(_region);
+	_header = reinterpret_cast<Header *>(base);
+	_slots = reinterpret_cast<Slot *>(base + 64 * ((sizeof(Header) + 63) / 64));
+	_index = reinterpret_cast<uint32_t *>(_slots + maxsize);
+
+	if (creator)
+		_init(maxsize);
+	else {
+		while (_header->_magic.load(std::memory_order_acquire) != MAGIC && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::yield();
+		if (_header->_magic.load(std::memory_order_acquire) != MAGIC)
+			_close("SharedLRUCache: timed out waiting for the creator; remove() the cache if it died");
+		if (_header->_key_size != sizeof(K) || _header->_value_size != sizeof(V)
+		    || _header->_maxsize != uint32_t(maxsize))
+			_close("SharedLRUCache: existing cache has other types or size");
+	}
+}
+
+
+template<class K, class V>
+SharedLRUCache<K, V>::~SharedLRUCache()
+{
+	::munmap(_region, _length_mapped);
+}
+
+
+template<class K, class V>
+void SharedLRUCache<K, V>::remove(const std::string & name)
+{
+	::shm_unlink(("/" + name).c_str());
+}
+
+
+template<class K, class V>
+void SharedLRUCache<K, V>::insert(const K & key, const V & value)
+{
+	Lock lock(*this);
+	Table table = _table();
+	uint32_t pos = table.lookup(key);
+	if (pos != NIL)
+		table.update(pos);
+	else
+		pos = table.insert(key, _header->_maxsize);
+	_slots[pos]._v = value;
+}
+
+
+template<class K, class V>
+bool SharedLRUCache<K, V>::find(const K & key, V & value)
+{
+	Lock lock(*this);
+	Table table = _table();
+	uint32_t pos = table.lookup(key);
+	if (pos == NIL)
+		return false;
+	table.update(pos);
+	value = _slots[pos]._v;
+	return true;
+}
+
+
+template<class K, class V>
+bool SharedLRUCache<K, V>::contains(const K & key) const
+{
+	Lock lock(*this);
+	return _table().lookup(key) != NIL;
+}
+
+
+template<class K, class V>
+int SharedLRUCache<K, V>::size() const
+{
+	Lock lock(*this);
+	return _header->_state._size;
+}
+
+
+template<class K, class V>
+int SharedLRUCache<K, V>::maxsize() const
+{
+	return _header->_maxsize;
+}
+
+
+template<class K, class V>
+bool SharedLRUCache<K, V>::empty() const
+{
+	return size() == 0;
+}
+
+
+template<class K, class V>
+void SharedLRUCache<K, V>::dump_mru_to_lru(std::ostream & os) const
+{
+	Lock lock(*this);
+	os << "SharedLRUCache(" << _header->_state._size << "/" << _header->_maxsize << "): MRU --> LRU: " << std::endl;
+	for (uint32_t pos = _header->_state._mru;  pos != NIL;  pos = _slots[pos]._older)
+		os << _slots[pos]._key << ": " << _slots[pos]._v << std::endl;
+}
+
+
+template<class K, class V>
+SharedLRUCache<K, V>::Lock::Lock(const SharedLRUCache & cache)
+	: _cache(cache)
+{
+	int ret = ::pthread_mutex_lock(&_cache._header->_mutex);
+	if (ret == EOWNERDEAD) {
+		_cache._reset();
+		::pthread_mutex_consistent(&_cache._header->_mutex);
+	}
+	else if (ret != 0)
+		throw "SharedLRUCache: cannot lock";
+}
+
+
+template<class K, class V>
+SharedLRUCache<K, V>::Lock::~Lock()
+{
+	::pthread_mutex_unlock(&_cache._header->_mutex);
+}
+
+
+// ftruncate() zero-fills the region: only the non-zero fields are set
+template<class K, class V>
+void SharedLRUCache<K, V>::_init(int maxsize)
+{
+	Header & h = *_header;
+	h._key_size = sizeof(K);
+	h._value_size = sizeof(V);
+	h._maxsize = maxsize;
+
+	pthread_mutexattr_t attr;
+	::pthread_mutexattr_init(&attr);
+	::pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	::pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	::pthread_mutex_init(&h._mutex, &attr);
+	::pthread_mutexattr_destroy(&attr);
+
+	_table().init(maxsize);
+	h._magic.store(MAGIC, std::memory_order_release);
+}
+
+
+// Pre-condition: the lock is held
+template<class K, class V>
+void SharedLRUCache<K, V>::_reset() const
+{
+	_table().clear();
+}
+
+
+// The const methods only look up
+template<class K, class V>
+typename SharedLRUCache<K, V>::Table SharedLRUCache<K, V>::_table() const
+{
+	return Table(_header->_state, _slots, _index);
+}
+
+
+template<class K, class V>
+void SharedLRUCache<K, V>::_close(const char * error)
+{
+	::munmap(_region, _length_mapped);
+	throw error;
+}
+
+
+}  // namespace plb
+
+#endif  // PLB_LRU_SHM_HPP
@@ -0,0 +1,237 @@
+/*
+ * Binary snapshots of an LRUCacheH4, for a warm restart.
+ *
+ * save_snapshot() writes the entries from MRU to LRU. load_snapshot() maps
+ * the file in memory and rebuilds the cache with the same recency order.
+ * If the cache is smaller than the snapshot, only the most recent entries
+ * are loaded, and the rest of the file is never read.
+ *
+ * Keys and values are written by LRUCacheH4Serializer: trivially copyable
+ * types are copied as is, std::string as a length and its bytes. Other types
+ * need a specialization. The format is not portable across architectures.
+ *
+ * Expiry times are not saved: loaded entries get the default TTL of the
+ * cache they are loaded into.
+ *
+ * See http://code.google.com/p/lru-cache-cpp/ for usage and limitations.
+ *
+ * Licensed under the GNU LGPL: http://www.gnu.org/copyleft/lesser.html
+ *
+ */
+
+#ifndef PLB_LRU_SNAPSHOT_HPP
+#define PLB_LRU_SNAPSHOT_HPP
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "lru.hpp"
+
+namespace plb {
+
+//-------------------------------------------------------------
+// Serializers
+//-------------------------------------------------------------
+
+// write() appends a value to the stream. read() and skip() parse one from
+// [pos, end) and return the position after it, or NULL if it is truncated.
+template<class T>
+struct LRUCacheH4Serializer
+{
+	static_assert(std::is_trivially_copyable<T>::value,
+	              "LRUCacheH4Serializer: needs a specialization for types that are not trivially copyable");
+
+	static void write(std::ostream & os, const T & t)
+	{
+		os.write(reinterpret_cast<const char *>(&t), sizeof(T));
+	}
+
+	static const char * read(const char * pos, const char * end, T & t)
+	{
+		if (size_t(end - pos) < sizeof(T))
+			return NULL;
+		std::memcpy(static_cast<void *>(&t), pos, sizeof(T));
+		return pos + sizeof(T);
+	}
+
+	static const char * skip(const char * pos, const char * end)
+	{
+		return size_t(end - pos) < sizeof(T) ? NULL : pos + sizeof(T);
+	}
+};
+
+
+template<>
+struct LRUCacheH4Serializer<std::string>
+{
+	static void write(std::ostream & os, const std::string & s)
+	{
+		uint32_t size = s.size();
+		os.write(reinterpret_cast<const char *>(&size), sizeof(size));
+		os.write(s.data(), size);
+	}
+
+	static const char * read(const char * pos, const char * end, std::string & s)
+	{
+		const char * data = skip(pos, end);
+		if (data)
+			s.assign(pos + sizeof(uint32_t), data);
+		return data;
+	}
+
+	static const char * skip(const char * pos, const char * end)
+	{
+		uint32_t size;
+		if (size_t(end - pos) < sizeof(size))
+			return NULL;
+		std::memcpy(&size, pos, sizeof(size));
+		pos += sizeof(size);
+		return size_t(end - pos) < size ? NULL : pos + size;
+	}
+};
+
+
+//-------------------------------------------------------------
+// Snapshots
+//-------------------------------------------------------------
+
+// File header, followed by the entries from MRU to LRU
+struct LRUCacheH4SnapshotHeader
+{
+	char _magic[8];                 // "PLBLRU1\0"
+	uint32_t _key_size;             // sizeof(K) and sizeof(V): a cheap check that
+	uint32_t _value_size;           // the snapshot was saved with the same types
+	uint64_t _entries;
+};
+
+
+// Flushes a file, or a directory, to the disk
+inline bool lru_cache_h4_sync(const std::string & path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	const bool ret = ::fsync(fd) == 0;
+	::close(fd);
+	return ret;
+}
+
+
+// The file is written under a temporary name and synced, then renamed, and
+// the rename synced: a crash, even of the host, leaves either the previous
+// snapshot or the new one
+template<class K, class V, class W, class H, class E>
+void save_snapshot(const LRUCacheH4<K, V, W, H, E> & cache, const std::string & path)
+{
+	typedef LRUCacheH4<K, V, W, H, E> Cache;
+
+	const std::string tmp = path + ".tmp";
+	std::ofstream file(tmp.c_str(), std::ios::binary | std::ios::trunc);
+	if (!file)
+		throw "save_snapshot: cannot open file";
+
+	LRUCacheH4SnapshotHeader header;
+	std::memcpy(header._magic, "PLBLRU1", 8);
+	header._key_size = sizeof(K);
+	header._value_size = sizeof(V);
+	header._entries = cache.size();
+	file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+	for (typename Cache::const_iterator it = cache.mru_begin();  it != cache.end();  ++it) {
+		LRUCacheH4Serializer<K>::write(file, it.key());
+		LRUCacheH4Serializer<V>::write(file, it.value());
+	}
+
+	file.close();
+	if (!file || !lru_cache_h4_sync(tmp) || std::rename(tmp.c_str(), path.c_str()) != 0) {
+		std::remove(tmp.c_str());
+		throw "save_snapshot: write failed";
+	}
+
+	const std::string::size_type slash = path.rfind('/');
+	const std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+	if (!lru_cache_h4_sync(dir))
+		throw "save_snapshot: cannot sync directory";
+}
+
+
+// The entries that fit are located first, then inserted from the LRU one
+// on, so that the MRU entry of the snapshot ends up MRU. Returns how many
+// entries were loaded.
+template<class K, class V, class W, class H, class E>
+int load_snapshot(LRUCacheH4<K, V, W, H, E> & cache, const std::string & path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw "load_snapshot: cannot open file";
+
+	struct stat st;
+	if (::fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(LRUCacheH4SnapshotHeader)) {
+		::close(fd);
+		throw "load_snapshot: not a snapshot";
+	}
+
+	const size_t length = st.st_size;
+	void * map = ::mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED)
+		throw "load_snapshot: cannot map file";
+	::madvise(map, length, MADV_SEQUENTIAL);
+
+	const char * begin = static_cast<const char *>(map);
+	const char * end = begin + length;
+	const char * error = NULL;
+	std::vector<const char *> entries;
+
+	LRUCacheH4SnapshotHeader header;
+	std::memcpy(&header, begin, sizeof(header));
+	if (std::memcmp(header._magic, "PLBLRU1", 8) != 0
+	    || header._key_size != sizeof(K) || header._value_size != sizeof(V))
+		error = "load_snapshot: not a snapshot of this cache type";
+	else {
+		const uint64_t count = std::min<uint64_t>(header._entries, cache.maxsize());
+		entries.reserve(count);
+		const char * pos = begin + sizeof(header);
+		for (uint64_t i = 0;  pos && i < count;  ++i) {
+			entries.push_back(pos);
+			pos = LRUCacheH4Serializer<K>::skip(pos, end);
+			if (pos)
+				pos = LRUCacheH4Serializer<V>::skip(pos, end);
+		}
+		if (!pos)
+			error = "load_snapshot: truncated snapshot";
+	}
+
+	try {
+		K key;
+		V value;
+		for (size_t i = entries.size();  !error && i-- > 0; ) {
+			const char * pos = LRUCacheH4Serializer<K>::read(entries[i], end, key);
+			LRUCacheH4Serializer<V>::read(pos, end, value);
+			cache.insert(key, value);
+		}
+	}
+	catch (...) {
+		::munmap(map, length);
+		throw;
+	}
+
+	::munmap(map, length);
+	if (error)
+		throw error;
+	return entries.size();
+}
+
+
+}  // namespace plb
+
+#endif  // PLB_LRU_SNAPSHOT_HPP
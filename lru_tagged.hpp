@@ -0,0 +1,234 @@
+/*
+ * LRU cache with a secondary index from tags to keys, for invalidation.
+ *
+ * Each entry is inserted with zero or more tags, a tenant or a table for
+ * example. invalidate(tag) erases all the entries carrying the tag in time
+ * proportional to their number, where erase_if() on the cache walks all of
+ * its entries.
+ *
+ * The index follows every removal from the cache, whether evicted, replaced
+ * or erased: a key is listed under a tag exactly while its entry is cached
+ * with that tag. It costs a hash set entry per tag of each entry. Not
+ * thread-safe.
+ *
+ * See http://code.google.com/p/lru-cache-cpp/ for usage and limitations.
+ *
+ * Licensed under the GNU LGPL: http://www.gnu.org/copyleft/lesser.html
+ *
+ */
+
+#ifndef PLB_LRU_TAGGED_HPP
+#define PLB_LRU_TAGGED_HPP
+
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "lru.hpp"
+
+namespace plb {
+
+//-------------------------------------------------------------
+// Tagged Cache
+//-------------------------------------------------------------
+
+template<class K, class V, class T>
+class TaggedCache
+{
+public:
+	typedef std::vector<T> Tags;
+
+public:
+	TaggedCache(int maxsize);                   // Pre-condition: maxsize >= 1
+
+	// Replaces the value and the tags of an existing entry
+	void insert(const K & key, const V & value);
+	void insert(const K & key, const V & value, const T & tag);
+	void insert(const K & key, const V & value, const Tags & tags);
+
+	bool find(const K & key, V & value);        // updates MRU
+	bool erase(const K & key);
+	int invalidate(const T & tag);              // erases the entries with the tag; returns how many
+	void clear();
+
+	int size() const;
+	int maxsize() const;
+	bool empty() const;
+	int tags() const;                           // distinct tags in use
+	int tag_size(const T & tag) const;          // entries with the tag
+
+private:
+	struct Entry
+	{
+		V _v;
+		Tags _tags;
+	};
+
+	typedef LRUCacheH4<K, Entry> Cache;
+	typedef std::unordered_set<K, LRUCacheH4Hash<K>, LRUCacheH4Equal<K> > Keys;
+	typedef std::unordered_map<T, Keys, LRUCacheH4Hash<T>, LRUCacheH4Equal<T> > Index;
+
+private:
+	TaggedCache(const TaggedCache & other);
+	TaggedCache & operator=(const TaggedCache & other);
+
+	void _sync();
+	void _untag(const K & key, const Tags & tags);
+
+private:
+	Cache _cache;
+	Index _index;
+};
+
+
+template<class K, class V, class T>
+TaggedCache<K, V, T>::TaggedCache(int maxsize)
+	: _cache(maxsize)
+{
+	// removals are queued, then taken out of the index after each operation
+	_cache.set_listener([](const K &, Entry &, LRUCacheH4Removal) { }, true);
+}
+
+
+template<class K, class V, class T>
+void TaggedCache<K, V, T>::insert(const K & key, const V & value)
+{
+	insert(key, value, Tags());
+}
+
+
+template<class K, class V, class T>
+void TaggedCache<K, V, T>::insert(const K & key, const V & value, const T & tag)
+{
+	insert(key, value, Tags(1, tag));
+}
+
+
+// The replaced entry is untagged before the new tags are added
+template<class K, class V, class T>
+void TaggedCache<K, V, T>::insert(const K & key, const V & value, const Tags & tags)
+{
+	Entry entry = { value, tags };
+	_cache.insert(key, entry);
+	_sync();
+	for (size_t i = 0;  i < tags.size();  ++i)
+		_index[tags[i]].insert(key);
+}
+
+
+template<class K, class V, class T>
+bool TaggedCache<K, V, T>::find(const K & key, V & value)
+{
+	typename Cache::const_iterator it = _cache.find(key);
+	const bool ret = it != _cache.end();
+	if (ret)
+		value = it.value()._v;
+	_sync();
+	return ret;
+}
+
+
+template<class K, class V, class T>
+bool TaggedCache<K, V, T>::erase(const K & key)
+{
+	const bool ret = _cache.erase(key);
+	_sync();
+	return ret;
+}
+
+
+// The keys are taken out of the index first: untagging them finds their
+// set gone
+template<class K, class V, class T>
+int TaggedCache<K, V, T>::invalidate(const T & tag)
+{
+	typename Index::iterator it = _index.find(tag);
+	if (it == _index.end())
+		return 0;
+
+	Keys keys;
+	keys.swap(it->second);
+	_index.erase(it);
+
+	int ret = 0;
+	for (typename Keys::const_iterator key = keys.begin();  key != keys.end();  ++key)
+		ret += _cache.erase(*key);
+	_sync();
+	return ret;
+}
+
+
+template<class K, class V, class T>
+void TaggedCache<K, V, T>::clear()
+{
+	_cache.clear();
+	typename Cache::Removals removed;
+	_cache.take_removals(removed);
+	_index.clear();
+}
+
+
+template<class K, class V, class T>
+int TaggedCache<K, V, T>::size() const
+{
+	return _cache.size();
+}
+
+
+template<class K, class V, class T>
+int TaggedCache<K, V, T>::maxsize() const
+{
+	return _cache.maxsize();
+}
+
+
+template<class K, class V, class T>
+bool TaggedCache<K, V, T>::empty() const
+{
+	return size() == 0;
+}
+
+
+template<class K, class V, class T>
+int TaggedCache<K, V, T>::tags() const
+{
+	return _index.size();
+}
+
+
+template<class K, class V, class T>
+int TaggedCache<K, V, T>::tag_size(const T & tag) const
+{
+	typename Index::const_iterator it = _index.find(tag);
+	return it == _index.end() ? 0 : it->second.size();
+}
+
+
+template<class K, class V, class T>
+void TaggedCache<K, V, T>::_sync()
+{
+	typename Cache::Removals removed;
+	_cache.take_removals(removed);
+	for (size_t i = 0;  i < removed.size();  ++i)
+		_untag(removed[i]._key, removed[i]._v._tags);
+}
+
+
+// A tag left without keys is dropped
+template<class K, class V, class T>
+void TaggedCache<K, V, T>::_untag(const K & key, const Tags & tags)
+{
+	for (size_t i = 0;  i < tags.size();  ++i) {
+		typename Index::iterator it = _index.find(tags[i]);
+		if (it == _index.end())
+			continue;
+		it->second.erase(key);
+		if (it->second.empty())
+			_index.erase(it);
+	}
+}
+
+
+}  // namespace plb
+
+#endif  // PLB_LRU_TAGGED_HPP
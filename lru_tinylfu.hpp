@@ -0,0 +1,335 @@
+/*
+ * W-TinyLFU: an LRU cache with a frequency-based admission filter.
+ *
+ * New entries go to a small window LRU. When the window overflows, its LRU
+ * entry becomes a candidate for the main LRU segment, and is only admitted
+ * if its estimated access frequency is higher than that of the main
+ * segment's LRU entry, which it would evict. A burst of one-off keys (a
+ * scan) therefore churns the window and leaves the main segment alone.
+ *
+ * Frequencies are estimated by a count-min sketch of 4-bit counters, 4 per
+ * entry of capacity, halved every 10 * maxsize accesses so that the
+ * estimates follow changes in popularity. An access is a hit of find(), an
+ * insert() or an operator[]: a find() that misses, followed by the insert()
+ * of the key, counts once.
+ *
+ * Reference: G. Einziger, R. Friedman, B. Manes, "TinyLFU: A Highly
+ * Efficient Cache Admission Policy", ACM ToS 2017.
+ *
+ * See http://code.google.com/p/lru-cache-cpp/ for usage and limitations.
+ *
+ * Licensed under the GNU LGPL: http://www.gnu.org/copyleft/lesser.html
+ *
+ */
+
+#ifndef PLB_LRU_TINYLFU_HPP
+#define PLB_LRU_TINYLFU_HPP
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+#include "lru.hpp"
+
+namespace plb {
+
+//-------------------------------------------------------------
+// Count-Min Sketch
+//-------------------------------------------------------------
+
+// 4 rows of 4-bit saturating counters, packed 16 to a word
+template<class K>
+class CountMinSketch4
+{
+public:
+	CountMinSketch4(int width);                 // counters per row, rounded up to a power of 2
+
+	void increment(const K & key);              // halves all counters every sample_size() increments
+	int frequency(const K & key) const;         // 0 to 15
+	int sample_size() const;
+
+private:
+	enum { DEPTH = 4 };
+
+	void _positions(const K & key, uint32_t * pos) const;
+	void _halve();
+
+private:
+	std::vector<uint64_t> _table;
+	uint32_t _mask;                             // width - 1
+	int _additions;
+	int _sample_size;
+};
+
+
+template<class K>
+CountMinSketch4<K>::CountMinSketch4(int width)
+	: _mask(15),
+	  _additions(0),
+	  _sample_size(10 * (width > 0 ? width : 1))
+{
+	uint32_t w = 16;
+	while (w < uint32_t(width))
+		w <<= 1;
+	_mask = w - 1;
+	_table.assign(DEPTH * w / 16, 0);
+}
+
+
+// Conservative update: only the smallest counters are incremented, which
+// keeps one heavy key from inflating the estimates of the keys it collides with
+template<class K>
+void CountMinSketch4<K>::increment(const K & key)
+{
+	uint32_t pos[DEPTH];
+	_positions(key, pos);
+
+	const int f = frequency(key);
+	if (f < 15) {
+		for (int i = 0;  i < DEPTH;  ++i) {
+			uint64_t & word = _table[pos[i] >> 4];
+			const int shift = (pos[i] & 15) << 2;
+			if (int((word >> shift) & 0xF) == f)
+				word += uint64_t(1) << shift;
+		}
+	}
+
+	if (++_additions >= _sample_size)
+		_halve();
+}
+
+
+template<class K>
+int CountMinSketch4<K>::frequency(const K & key) const
+{
+	uint32_t pos[DEPTH];
+	_positions(key, pos);
+
+	int ret = 15;
+	for (int i = 0;  i < DEPTH;  ++i) {
+		int count = int((_table[pos[i] >> 4] >> ((pos[i] & 15) << 2)) & 0xF);
+		if (count < ret)
+			ret = count;
+	}
+	return ret;
+}
+
+
+template<class K>
+int CountMinSketch4<K>::sample_size() const
+{
+	return _sample_size;
+}
+
+
+// Double hashing over a mixed hash: row i gets h1 + i * h2
+template<class K>
+void CountMinSketch4<K>::_positions(const K & key, uint32_t * pos) const
+{
+	uint64_t h = __gnu_cxx::hash<K>()(key) * 0x9E3779B97F4A7C15ULL;
+	h ^= h >> 29;
+	const uint32_t h1 = uint32_t(h);
+	const uint32_t h2 = uint32_t(h >> 32) | 1;
+	for (int i = 0;  i < DEPTH;  ++i)
+		pos[i] = i * (_mask + 1) + ((h1 + i * h2) & _mask);
+}
+
+
+template<class K>
+void CountMinSketch4<K>::_halve()
+{
+	for (size_t i = 0;  i < _table.size();  ++i)
+		_table[i] = (_table[i] >> 1) & 0x7777777777777777ULL;
+	_additions /= 2;
+}
+
+
+//-------------------------------------------------------------
+// W-TinyLFU Cache
+//-------------------------------------------------------------
+
+template<class K, class V>
+class TinyLFUCache
+{
+public:
+	typedef typename LRUCacheH4<K, V>::const_iterator const_iterator;
+
+public:
+	// Pre-condition: maxsize >= 2. The window gets 1% of it, at least 1.
+	TinyLFUCache(int maxsize);
+
+	V & operator[](const K & key);              // an access
+	void insert(const K & key, const V & value);
+
+	int size() const;
+	int maxsize() const;
+	bool empty() const;
+	int window_size() const;
+	int frequency(const K & key) const;         // estimated, 0 to 15
+
+	const_iterator find(const K & key);         // an access if found, updates the MRU
+	const_iterator find(const K & key) const;   // not an access
+	const_iterator end() const;
+
+	void dump_mru_to_lru(std::ostream & os) const;
+
+private:
+	TinyLFUCache(const TinyLFUCache & other);
+	TinyLFUCache & operator=(const TinyLFUCache & other);
+
+	V * _lookup(const K & key);
+	V & _insert(const K & key, const V & value);
+
+private:
+	CountMinSketch4<K> _sketch;
+	LRUCacheH4<K, V> _window;
+	LRUCacheH4<K, V> _main;
+	int _maxsize;
+};
+
+
+template<class K, class V>
+TinyLFUCache<K, V>::TinyLFUCache(int maxsize)
+	: _sketch(maxsize),
+	  _window(maxsize >= 200 ? maxsize / 100 : 1),
+	  _main(maxsize >= 200 ? maxsize - maxsize / 100 : (maxsize > 1 ? maxsize - 1 : 1)),
+	  _maxsize(maxsize)
+{
+	if (_maxsize <= 1)
+		throw "TinyLFUCache: expecting cache size >= 2";
+}
+
+
+template<class K, class V>
+V & TinyLFUCache<K, V>::operator[](const K & key)
+{
+	_sketch.increment(key);
+	V * value = _lookup(key);
+	return value ? *value : _insert(key, V());
+}
+
+
+// An access too: a key written and never read still gains frequency
+template<class K, class V>
+void TinyLFUCache<K, V>::insert(const K & key, const V & value)
+{
+	_sketch.increment(key);
+	const LRUCacheH4<K, V> & window = _window;
+	const LRUCacheH4<K, V> & main = _main;
+	if (window.find(key) != window.end())
+		_window.insert(key, value);
+	else if (main.find(key) != main.end())
+		_main.insert(key, value);
+	else
+		_insert(key, value);
+}
+
+
+template<class K, class V>
+int TinyLFUCache<K, V>::size() const
+{
+	return _window.size() + _main.size();
+}
+
+
+template<class K, class V>
+int TinyLFUCache<K, V>::maxsize() const
+{
+	return _maxsize;
+}
+
+
+template<class K, class V>
+bool TinyLFUCache<K, V>::empty() const
+{
+	return size() == 0;
+}
+
+
+template<class K, class V>
+int TinyLFUCache<K, V>::window_size() const
+{
+	return _window.maxsize();
+}
+
+
+template<class K, class V>
+int TinyLFUCache<K, V>::frequency(const K & key) const
+{
+	return _sketch.frequency(key);
+}
+
+
+template<class K, class V>
+typename TinyLFUCache<K, V>::const_iterator TinyLFUCache<K, V>::find(const K & key)
+{
+	const_iterator it = _window.find(key);
+	if (it == _window.end())
+		it = _main.find(key);
+	if (it != _main.end())
+		_sketch.increment(key);
+	return it;
+}
+
+
+template<class K, class V>
+typename TinyLFUCache<K, V>::const_iterator TinyLFUCache<K, V>::find(const K & key) const
+{
+	const LRUCacheH4<K, V> & window = _window;
+	const LRUCacheH4<K, V> & main = _main;
+	const_iterator it = window.find(key);
+	return it != window.end() ? it : main.find(key);
+}
+
+
+template<class K, class V>
+typename TinyLFUCache<K, V>::const_iterator TinyLFUCache<K, V>::end() const
+{
+	return _main.end();
+}
+
+
+template<class K, class V>
+void TinyLFUCache<K, V>::dump_mru_to_lru(std::ostream & os) const
+{
+	os << "TinyLFUCache(" << size() << "/" << maxsize() << ")" << std::endl;
+	os << "window: ";
+	_window.dump_mru_to_lru(os);
+	os << "main: ";
+	_main.dump_mru_to_lru(os);
+}
+
+
+// One lookup per segment, updating its MRU; 0 if absent
+template<class K, class V>
+V * TinyLFUCache<K, V>::_lookup(const K & key)
+{
+	const_iterator it = _window.find(key);
+	if (it == _window.end()) {
+		it = _main.find(key);
+		if (it == _main.end())
+			return 0;
+	}
+	return &const_cast<V &>(it.value());
+}
+
+
+// The window's LRU entry, pushed out by the new key, competes with the main
+// segment's LRU entry for its place. If admitted, its value is moved across
+// before the window recycles its node. Pre-condition: key is not cached.
+template<class K, class V>
+V & TinyLFUCache<K, V>::_insert(const K & key, const V & value)
+{
+	if (_window.size() >= _window.maxsize()) {
+		const_iterator lru = _window.lru_begin();
+		if (_main.size() < _main.maxsize()
+		    || _sketch.frequency(lru.key()) > _sketch.frequency(_main.lru_begin().key()))
+			_main.insert_or_assign(lru.key(), std::move(const_cast<V &>(lru.value())));
+	}
+
+	return const_cast<V &>(_window.try_emplace(key, value).first.value());
+}
+
+
+}  // namespace plb
+
+#endif  // PLB_LRU_TINYLFU_HPP
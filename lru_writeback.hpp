@@ -0,0 +1,474 @@
+/*
+ * Thread-safe write-back LRU cache in front of a slow backing store.
+ *
+ * insert() only updates the cache and marks the entry dirty: repeated
+ * writes to a key coalesce into one store write. Dirty entries are written
+ * to the store in batches:
+ *  - when they are evicted: evicted dirty entries are kept aside, and still
+ *    served by find() and get(), until batch_size of them are pending,
+ *  - on flush(), which also writes the dirty entries still in the cache,
+ *  - every interval milliseconds if given, by a background thread,
+ *  - on destruction.
+ *
+ * Store writes and reads run outside the cache lock, one flush at a time,
+ * reads waiting for the flush in progress. A failed write (the store
+ * throws) is retried by the next flush. The dirty keys are indexed: a flush
+ * costs the dirty entries, not the size of the cache.
+ *
+ * See http://code.google.com/p/lru-cache-cpp/ for usage and limitations.
+ *
+ * Licensed under the GNU LGPL: http://www.gnu.org/copyleft/lesser.html
+ *
+ */
+
+#ifndef PLB_LRU_WRITEBACK_HPP
+#define PLB_LRU_WRITEBACK_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "lru.hpp"
+
+namespace plb {
+
+//-------------------------------------------------------------
+// Backing stores
+//-------------------------------------------------------------
+
+template<class K, class V>
+class BackingStore
+{
+public:
+	typedef std::vector<std::pair<K, V> > Batch;
+
+public:
+	virtual ~BackingStore() { }
+
+	// Applied in order: when a key appears twice, the last value wins.
+	// Called by one thread at a time, possibly concurrently with read().
+	virtual void write(const Batch & batch) = 0;
+	virtual bool read(const K & key, V & value) = 0;
+};
+
+
+// Appends "key value" lines to a file, for tests and tools: a read scans
+// the whole file. K and V must be readable and writable with >> and <<.
+template<class K, class V>
+class FileBackingStore : public BackingStore<K, V>
+{
+public:
+	typedef typename BackingStore<K, V>::Batch Batch;
+
+public:
+	FileBackingStore(const std::string & path);     // appends to the file if it exists
+
+	virtual void write(const Batch & batch);
+	virtual bool read(const K & key, V & value);
+
+	long writes() const;                            // records written so far
+	long batches() const;                           // calls to write() so far
+
+private:
+	typedef std::lock_guard<std::mutex> Lock;
+
+private:
+	mutable std::mutex _mutex;
+	std::string _path;
+	long _writes;
+	long _batches;
+};
+
+
+template<class K, class V>
+FileBackingStore<K, V>::FileBackingStore(const std::string & path)
+	: _path(path),
+	  _writes(0),
+	  _batches(0)
+{
+	std::ofstream file(_path.c_str(), std::ios::app);
+	if (!file)
+		throw "FileBackingStore: cannot open file";
+}
+
+
+template<class K, class V>
+void FileBackingStore<K, V>::write(const Batch & batch)
+{
+	Lock lock(_mutex);
+	std::ofstream file(_path.c_str(), std::ios::app);
+	for (size_t i = 0;  i < batch.size();  ++i)
+		file << batch[i].first << " " << batch[i].second << "\n";
+	file.flush();
+	if (!file)
+		throw "FileBackingStore: write failed";
+	_writes += batch.size();
+	++_batches;
+}
+
+
+template<class K, class V>
+bool FileBackingStore<K, V>::read(const K & key, V & value)
+{
+	Lock lock(_mutex);
+	std::ifstream file(_path.c_str());
+	bool ret = false;
+	K k;
+	V v;
+	while (file >> k >> v) {
+		if (k == key) {
+			value = v;
+			ret = true;
+		}
+	}
+	return ret;
+}
+
+
+template<class K, class V>
+long FileBackingStore<K, V>::writes() const
+{
+	Lock lock(_mutex);
+	return _writes;
+}
+
+
+template<class K, class V>
+long FileBackingStore<K, V>::batches() const
+{
+	Lock lock(_mutex);
+	return _batches;
+}
+
+
+//-------------------------------------------------------------
+// Write-back Cache
+//-------------------------------------------------------------
+
+template<class K, class V>
+class WriteBackCache
+{
+public:
+	typedef BackingStore<K, V> Store;
+
+public:
+	// Pre-condition: maxsize >= 1, batch_size >= 1. interval 0: no background flush.
+	WriteBackCache(int maxsize, Store & store, int batch_size = 64, unsigned int interval = 0);
+	~WriteBackCache();                          // flushes
+
+	void insert(const K & key, const V & value);   // marks the entry dirty
+	bool find(const K & key, V & value);        // never reads the store
+	bool get(const K & key, V & value);         // reads the store on a miss, caches the value
+
+	int flush();                                // writes all dirty entries; returns how many
+
+	int size() const;
+	int maxsize() const;
+	bool empty() const;
+	int dirty() const;                          // entries not written yet, in the cache or evicted
+
+private:
+	// An evicted entry is forgotten once written, unless evicted again since
+	struct Evicted
+	{
+		Evicted(const V & v, unsigned long generation) : _v(v), _generation(generation) { }
+
+		V _v;
+		unsigned long _generation;
+	};
+
+	typedef LRUCacheH4<K, V> Cache;
+	typedef std::unordered_map<K, Evicted, LRUCacheH4Hash<K>, LRUCacheH4Equal<K> > EvictedMap;
+	typedef std::unordered_set<K, LRUCacheH4Hash<K>, LRUCacheH4Equal<K> > DirtySet;
+	typedef std::lock_guard<std::mutex> Lock;
+	typedef std::unique_lock<std::mutex> UniqueLock;
+
+private:
+	WriteBackCache(const WriteBackCache & other);
+	WriteBackCache & operator=(const WriteBackCache & other);
+
+	bool _find(const K & key, V & value);
+	void _put(const K & key, const V & value, bool dirty);
+	int _flush(bool all);
+	void _work();
+
+private:
+	mutable std::mutex _mutex;
+	Cache _cache;
+	EvictedMap _evicted;                        // dirty entries evicted, not written yet
+	unsigned long _generation;
+	DirtySet _dirty;                            // keys of the dirty entries in the cache
+	Store & _store;
+	int _batch_size;
+
+	// held by a flush so that writes stay in order, shared by the store reads
+	// so that none reads a key while its value is being written
+	std::shared_mutex _flush_mutex;
+
+	unsigned int _interval;
+	std::condition_variable _wake;
+	std::thread _worker;
+	bool _stop;
+};
+
+
+template<class K, class V>
+WriteBackCache<K, V>::WriteBackCache(int maxsize, Store & store, int batch_size, unsigned int interval)
+	: _cache(maxsize),
+	  _generation(0),
+	  _store(store),
+	  _batch_size(batch_size),
+	  _interval(interval),
+	  _stop(false)
+{
+	if (_batch_size <= 0)
+		throw "WriteBackCache: expecting batch size >= 1";
+
+	// the removals are only taken, never delivered
+	_cache.set_listener([](const K &, V &, LRUCacheH4Removal) { }, true);
+	if (_interval)
+		_worker = std::thread(&WriteBackCache::_work, this);
+}
+
+
+template<class K, class V>
+WriteBackCache<K, V>::~WriteBackCache()
+{
+	if (_worker.joinable()) {
+		{
+			Lock lock(_mutex);
+			_stop = true;
+		}
+		_wake.notify_all();
+		_worker.join();
+	}
+	try {
+		flush();
+	}
+	catch (...) {
+	}
+}
+
+
+template<class K, class V>
+void WriteBackCache<K, V>::insert(const K & key, const V & value)
+{
+	UniqueLock lock(_mutex);
+	_put(key, value, true);
+	const bool full = int(_evicted.size()) >= _batch_size;
+	lock.unlock();
+
+	if (full)
+		_flush(false);
+}
+
+
+template<class K, class V>
+bool WriteBackCache<K, V>::find(const K & key, V & value)
+{
+	Lock lock(_mutex);
+	return _find(key, value);
+}
+
+
+// The store is read outside the cache lock, but not during a flush: a value
+// being written back is then either in the cache, in _evicted or in the
+// store. The key is looked up again after the read, in case it was
+// inserted meanwhile.
+template<class K, class V>
+bool WriteBackCache<K, V>::get(const K & key, V & value)
+{
+	{
+		Lock lock(_mutex);
+		if (_find(key, value))
+			return true;
+	}
+
+	std::shared_lock<std::shared_mutex> flush_lock(_flush_mutex);
+	{
+		Lock lock(_mutex);
+		if (_find(key, value))
+			return true;
+	}
+	V loaded;
+	if (!_store.read(key, loaded))
+		return false;
+
+	Lock lock(_mutex);
+	if (_find(key, value))
+		return true;
+	value = loaded;
+	_put(key, value, false);
+	return true;
+}
+
+
+template<class K, class V>
+int WriteBackCache<K, V>::flush()
+{
+	return _flush(true);
+}
+
+
+template<class K, class V>
+int WriteBackCache<K, V>::size() const
+{
+	Lock lock(_mutex);
+	return _cache.size();
+}
+
+
+template<class K, class V>
+int WriteBackCache<K, V>::maxsize() const
+{
+	return _cache.maxsize();
+}
+
+
+template<class K, class V>
+bool WriteBackCache<K, V>::empty() const
+{
+	return size() == 0;
+}
+
+
+template<class K, class V>
+int WriteBackCache<K, V>::dirty() const
+{
+	Lock lock(_mutex);
+	return _dirty.size() + _evicted.size();
+}
+
+
+// Pre-condition: lock held
+template<class K, class V>
+bool WriteBackCache<K, V>::_find(const K & key, V & value)
+{
+	typename Cache::const_iterator it = _cache.find(key);
+	if (it != _cache.end()) {
+		value = it.value();
+		return true;
+	}
+
+	typename EvictedMap::const_iterator evicted = _evicted.find(key);
+	if (evicted == _evicted.end())
+		return false;
+	value = evicted->second._v;
+	return true;
+}
+
+
+// Pre-condition: lock held. Evicted dirty entries are set aside.
+template<class K, class V>
+void WriteBackCache<K, V>::_put(const K & key, const V & value, bool dirty)
+{
+	_cache.insert(key, value);
+	if (dirty)
+		_dirty.insert(key);
+	else
+		_dirty.erase(key);
+
+	typename Cache::Removals removed;
+	_cache.take_removals(removed);
+	for (size_t i = 0;  i < removed.size();  ++i) {
+		if (removed[i]._cause == LRU_EVICTED && _dirty.erase(removed[i]._key) > 0) {
+			typename EvictedMap::iterator e = _evicted.find(removed[i]._key);
+			if (e != _evicted.end())
+				e->second = Evicted(removed[i]._v, ++_generation);
+			else
+				_evicted.insert(std::make_pair(removed[i]._key, Evicted(removed[i]._v, ++_generation)));
+		}
+	}
+}
+
+
+// Evicted entries come first in the batch: a key both evicted and dirty
+// again in the cache has its newer value last
+template<class K, class V>
+int WriteBackCache<K, V>::_flush(bool all)
+{
+	std::unique_lock<std::shared_mutex> flush_lock(_flush_mutex);
+	typename Store::Batch batch;
+	std::vector<unsigned long> generations;
+	size_t evicted;
+	unsigned long since;
+	{
+		Lock lock(_mutex);
+		for (typename EvictedMap::const_iterator it = _evicted.begin();  it != _evicted.end();  ++it) {
+			batch.push_back(std::make_pair(it->first, it->second._v));
+			generations.push_back(it->second._generation);
+		}
+		evicted = batch.size();
+		since = _generation;
+
+		if (all) {
+			for (typename DirtySet::const_iterator it = _dirty.begin();  it != _dirty.end();  ++it)
+				batch.push_back(std::make_pair(*it, static_cast<const Cache &>(_cache).find(*it).value()));
+			_dirty.clear();
+		}
+	}
+	if (batch.empty())
+		return 0;
+
+	try {
+		_store.write(batch);
+	}
+	catch (...) {
+		// the cache entries are dirty again: those still cached are marked,
+		// the others set aside with the evicted ones. A value evicted since
+		// the batch was taken is newer, and stays.
+		Lock lock(_mutex);
+		for (size_t i = evicted;  i < batch.size();  ++i) {
+			const K & key = batch[i].first;
+			typename EvictedMap::iterator e = _evicted.find(key);
+			if (e != _evicted.end() && e->second._generation > since)
+				continue;
+			if (static_cast<const Cache &>(_cache).find(key) != _cache.end())
+				_dirty.insert(key);
+			else if (e != _evicted.end())
+				e->second = Evicted(batch[i].second, ++_generation);
+			else
+				_evicted.insert(std::make_pair(key, Evicted(batch[i].second, ++_generation)));
+		}
+		throw;
+	}
+
+	Lock lock(_mutex);
+	for (size_t i = 0;  i < evicted;  ++i) {
+		typename EvictedMap::iterator it = _evicted.find(batch[i].first);
+		if (it != _evicted.end() && it->second._generation == generations[i])
+			_evicted.erase(it);
+	}
+	return batch.size();
+}
+
+
+template<class K, class V>
+void WriteBackCache<K, V>::_work()
+{
+	UniqueLock lock(_mutex);
+	while (!_stop) {
+		_wake.wait_for(lock, std::chrono::milliseconds(_interval));
+		if (_stop)
+			return;
+		lock.unlock();
+		try {
+			_flush(true);
+		}
+		catch (...) {
+		}
+		lock.lock();
+	}
+}
+
+
+}  // namespace plb
+
+#endif  // PLB_LRU_WRITEBACK_HPP
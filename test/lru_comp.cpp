@@ -6,14 +6,31 @@
 //    Use this in conjunction to the unit tests (lru_tests.cpp)
 //-------------------------------------------------------------
 
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <chrono>
 #include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
 #include <boost/timer.hpp>
 #include <boost/assign/list_of.hpp>
 #include <boost/lexical_cast.hpp>
 #include "../lru.hpp"
+#include "../lru_sharded.hpp"
+#include "../lru_clock.hpp"
+#include "../lru_flat.hpp"
+#include "../lru_arc.hpp"
+#include "../lru_tinylfu.hpp"
+#include "../lru_snapshot.hpp"
+#include "../lru_mrc.hpp"
 #include "lru_cache.h"
 #include "smaps.hpp"
+#include "trace.hpp"
+#include "workload.hpp"
 
 using namespace std;
 
@@ -38,7 +55,8 @@ void show_memory_usage()
 
 enum TestCase {
 	TEST_CASE_INSERT = 0,
-	TEST_CASE_INSERT_READ
+	TEST_CASE_INSERT_READ,
+	TEST_CASE_REPLAY
 };
 
 
@@ -46,10 +64,21 @@ ostream & operator<<(ostream & os, const TestCase & tc)
 {
 	return os << (tc == TEST_CASE_INSERT ? "TEST_CASE_INSERT" :
 		          tc == TEST_CASE_INSERT_READ ? "TEST_CASE_INSERT_READ" :
+		          tc == TEST_CASE_REPLAY ? "TEST_CASE_REPLAY" :
 		          "TEST_CASE_UNKNOWN");
 }
 
 
+enum Workload {
+	WORKLOAD_RAND = 0,      // rand() % num_keys
+	WORKLOAD_UNIFORM,
+	WORKLOAD_ZIPF,
+	WORKLOAD_SCAN,
+	WORKLOAD_DRIFT,
+	WORKLOAD_LOOP
+};
+
+
 struct TestParams
 {
 	TestParams(int cache_size,
@@ -63,7 +92,10 @@ struct TestParams
 		insertions(insertions),
 		report_memory(report_memory),
 		report_cpu(report_cpu),
-		show_header(show_header)
+		show_header(show_header),
+		trace(NULL),
+		workload(WORKLOAD_RAND),
+		skew(0.99)
 	{
 	}
 	
@@ -71,7 +103,20 @@ struct TestParams
 	{
 		return "c" + boost::lexical_cast<string>(cache_size) + "_" +
 		       "k" + boost::lexical_cast<string>(num_keys) + "_" +
-			   "i" + boost::lexical_cast<string>(insertions);
+			   "i" + boost::lexical_cast<string>(insertions) +
+		       (workload == WORKLOAD_UNIFORM ? "_uniform" :
+		        workload == WORKLOAD_ZIPF ? "_zipf" + skew_name() :
+		        workload == WORKLOAD_SCAN ? "_scan" :
+		        workload == WORKLOAD_DRIFT ? "_drift" :
+		        workload == WORKLOAD_LOOP ? "_loop" :
+		        "");
+	}
+	
+	string skew_name() const
+	{
+		ostringstream os;
+		os << skew;
+		return os.str();
 	}
 	
 	int cache_size;
@@ -80,13 +125,38 @@ struct TestParams
 	bool report_memory;
 	bool report_cpu;
 	bool show_header;
+	const plb::trace_file * trace;   // replayed by TEST_CASE_REPLAY
+	Workload workload;
+	double skew;                     // of WORKLOAD_ZIPF
 };
 
 
+// The hot sets take half the cache: LRU keeps them if it resists the rest.
+// Returns NULL for WORKLOAD_RAND.
+plb::key_generator * make_keys(const TestParams & params, uint64_t seed)
+{
+	const int hot_keys = max(min(params.cache_size / 2, params.num_keys), 1);
+	switch (params.workload) {
+		case WORKLOAD_UNIFORM:
+			return new plb::uniform_keys(params.num_keys, seed);
+		case WORKLOAD_ZIPF:
+			return new plb::zipf_keys(params.num_keys, params.skew, seed);
+		case WORKLOAD_SCAN:
+			return new plb::scan_keys(params.num_keys, hot_keys, 0.2, seed);
+		case WORKLOAD_DRIFT:
+			return new plb::drift_keys(params.num_keys, hot_keys, 0.9, 10, seed);
+		case WORKLOAD_LOOP:
+			return new plb::loop_keys(params.num_keys);
+		default:
+			return NULL;
+	}
+}
+
+
 template<class K, class V>
 struct TestDriver
 {
-	TestDriver(const TestParams & params) : params(params)
+	TestDriver(const TestParams & params) : params(params), hits(0), reads(0), hit_bytes(0), read_bytes(0)
 	{
 	}
 	
@@ -116,6 +186,9 @@ struct TestDriver
 			case TEST_CASE_INSERT_READ:
 				test_insert_read();
 				break;
+			case TEST_CASE_REPLAY:
+				test_replay();
+				break;
 			default:
 				break;
 		}
@@ -124,6 +197,12 @@ struct TestDriver
 			double elapsed = t->elapsed();
 			cerr << "elapsed: " << elapsed << endl;
 			cerr << "rate: " << rate(elapsed) << endl;
+			if (tc == TEST_CASE_INSERT_READ || tc == TEST_CASE_REPLAY)
+				cerr << "hit ratio: " << hit_ratio() << endl;
+			if (read_bytes > 0)
+				cerr << "byte hit ratio: " << double(hit_bytes) / read_bytes << endl;
+			if (keys.get())
+				cerr << "keys: " << keys->name() << endl;
 		}
 		
 		if (params.report_memory) {
@@ -143,18 +222,47 @@ struct TestDriver
 	
 		for (int i = 0;  i < params.insertions;  ++i)
 			ret += do_fetch_or_insert(get_key());
+		reads += params.insertions;
 	
 		return ret;
 	}
 	
+	// A GET is a fetch that inserts on a miss, as in TEST_CASE_INSERT_READ.
+	// Pre-condition: params.insertions is the number of records.
+	int test_replay()
+	{
+		int ret = 0;
+		plb::trace_record record;
+		for (const char * pos = params.trace->begin();  pos < params.trace->end(); ) {
+			pos = plb::trace_file::read(pos, record);
+			const K key = record.key;
+			if (record.op == plb::TRACE_GET) {
+				const int before = hits;
+				ret += do_fetch_or_insert(key);
+				++reads;
+				read_bytes += record.size;
+				if (hits != before)
+					hit_bytes += record.size;
+			}
+			else if (record.op == plb::TRACE_SET) {
+				do_insert(key, get_value());
+			}
+			else {
+				do_erase(key);
+			}
+		}
+		return ret;
+	}
+	
 	void init_rand()
 	{
 		srand(171);
+		keys.reset(make_keys(params, 171));
 	}
 	
 	K get_key()
 	{
-		return rand() % params.num_keys;
+		return keys.get() ? keys->next() : rand() % params.num_keys;
 	}
 	
 	V get_value()
@@ -166,14 +274,30 @@ struct TestDriver
 	{
 		return (elapsed > 0.0 ? params.insertions / elapsed : 0.0);
 	}
+	
+	double hit_ratio() const
+	{
+		return (reads > 0 ? double(hits) / reads : 0.0);
+	}
 
 	virtual void create_cache() = 0;
 	
 	virtual void do_insert(const K & key, const V & value) = 0;
 	
+	// counts a hit in hits
 	virtual V do_fetch_or_insert(const K & key) = 0;
 	
+	// caches without erase() ignore the deletes of a trace
+	virtual void do_erase(const K & key)
+	{
+	}
+	
 	TestParams params;
+	std::unique_ptr<plb::key_generator> keys;
+	int hits;
+	long reads;
+	long hit_bytes;
+	long read_bytes;
 };
 
 
@@ -198,6 +322,7 @@ struct TestDriverPLB : public TestDriver<K, V>
 	{
 		typename plb::LRUCacheH4<K, V>::const_iterator it = cache->find(key);
 		if (it != cache->end()) {
+			++TestDriver<K, V>::hits;
 			return it.value();
 		}
 		else {
@@ -206,11 +331,121 @@ struct TestDriverPLB : public TestDriver<K, V>
 			return value;
 		}
 	}
+	
+	virtual void do_erase(const K & key)
+	{
+		cache->erase(key);
+	}
 
 	std::auto_ptr<plb::LRUCacheH4<K, V> > cache;
 };
 
 
+template<class K, class V>
+struct TestDriverFlat : public TestDriver<K, V>
+{
+	TestDriverFlat(const TestParams & params) : TestDriver<K, V>(params)
+	{
+	}
+	
+	virtual void create_cache()
+	{
+		cache.reset(new plb::LRUCacheFlat<K, V>(TestDriver<K, V>::params.cache_size));
+	}
+	
+	virtual void do_insert(const K & key, const V & value)
+	{
+		(*cache)[key] = value;
+	}
+	
+	virtual V do_fetch_or_insert(const K & key)
+	{
+		typename plb::LRUCacheFlat<K, V>::const_iterator it = cache->find(key);
+		if (it != cache->end()) {
+			++TestDriver<K, V>::hits;
+			return it.value();
+		}
+		else {
+			V value = TestDriver<K, V>::get_value();
+			(*cache)[key] = value;
+			return value;
+		}
+	}
+
+	std::auto_ptr<plb::LRUCacheFlat<K, V> > cache;
+};
+
+
+template<class K, class V>
+struct TestDriverARC : public TestDriver<K, V>
+{
+	TestDriverARC(const TestParams & params) : TestDriver<K, V>(params)
+	{
+	}
+	
+	virtual void create_cache()
+	{
+		cache.reset(new plb::ARCCache<K, V>(TestDriver<K, V>::params.cache_size));
+	}
+	
+	virtual void do_insert(const K & key, const V & value)
+	{
+		(*cache)[key] = value;
+	}
+	
+	virtual V do_fetch_or_insert(const K & key)
+	{
+		typename plb::ARCCache<K, V>::const_iterator it = cache->find(key);
+		if (it != cache->end()) {
+			++TestDriver<K, V>::hits;
+			return it.value();
+		}
+		else {
+			V value = TestDriver<K, V>::get_value();
+			(*cache)[key] = value;
+			return value;
+		}
+	}
+
+	std::auto_ptr<plb::ARCCache<K, V> > cache;
+};
+
+
+template<class K, class V>
+struct TestDriverTinyLFU : public TestDriver<K, V>
+{
+	TestDriverTinyLFU(const TestParams & params) : TestDriver<K, V>(params)
+	{
+	}
+	
+	virtual void create_cache()
+	{
+		cache.reset(new plb::TinyLFUCache<K, V>(TestDriver<K, V>::params.cache_size));
+	}
+	
+	virtual void do_insert(const K & key, const V & value)
+	{
+		(*cache)[key] = value;
+	}
+	
+	virtual V do_fetch_or_insert(const K & key)
+	{
+		typename plb::TinyLFUCache<K, V>::const_iterator it = cache->find(key);
+		if (it != cache->end()) {
+			++TestDriver<K, V>::hits;
+			return it.value();
+		}
+		else {
+			V value = TestDriver<K, V>::get_value();
+			cache->insert(key, value);
+			return value;
+		}
+	}
+
+	std::auto_ptr<plb::TinyLFUCache<K, V> > cache;
+};
+
+
 template<class K, class V>
 struct TestDriverPA : public TestDriver<K, V>
 {
@@ -231,6 +466,7 @@ struct TestDriverPA : public TestDriver<K, V>
 	virtual V do_fetch_or_insert(const K & key)
 	{
 		if (cache->exists(key)) {
+			++TestDriver<K, V>::hits;
 			return cache->fetch(key);
 		}
 		else {
@@ -240,6 +476,11 @@ struct TestDriverPA : public TestDriver<K, V>
 		}
 	}
 	
+	virtual void do_erase(const K & key)
+	{
+		cache->remove(key);
+	}
+	
 	std::auto_ptr<LRUCache<K, V> > cache;
 };
 
@@ -267,14 +508,21 @@ struct TestComparator
 		TestDriverPLB<K, V> plb(sub);
 		plb.do_test(tc);
 		
+		TestDriverFlat<K, V> flat(sub);
+		flat.do_test(tc);
+		
 		TestDriverPA<K, V> pa(sub);
 		pa.do_test(tc);
 		
 		bool ret = check(*plb.cache, *pa.cache);
 		cerr << "ret=" << ret << endl;
+		
+		ret = check(*flat.cache, *pa.cache);
+		cerr << "flat ret=" << ret << endl;
 	}
 	
-	bool check(const plb::LRUCacheH4<K, V> & plb_cache,
+	template<class C>
+	bool check(const C & plb_cache,
 			   /*const*/ LRUCache<K, V> & pa_cache) const
 	{
 		const int plb_size = plb_cache.size();
@@ -288,7 +536,7 @@ struct TestComparator
 		
 		vector<int> pa_keys = pa_cache.get_all_keys();
 		int i = 0;
-		for (plb::LRUCacheH4<int, int>::const_iterator it = plb_cache.mru_begin();  it != plb_cache.end();  ++it, ++i)
+		for (typename C::const_iterator it = plb_cache.mru_begin();  it != plb_cache.end();  ++it, ++i)
 		{
 			const K & plb_key = it.key();
 			const K & pa_key = pa_keys[i];
@@ -312,10 +560,489 @@ struct TestComparator
 };
 
 
+// A few KB of payload that counts how often it is copied
+struct HeavyValue
+{
+	HeavyValue() : data() { }
+	HeavyValue(size_t n, char c) : data(n, c) { }
+	HeavyValue(const HeavyValue & other) : data(other.data) { ++copies; }
+	HeavyValue(HeavyValue && other) = default;
+	HeavyValue & operator=(const HeavyValue & other) { data = other.data; ++copies; return *this; }
+	HeavyValue & operator=(HeavyValue && other) = default;
+
+	vector<char> data;
+	static long copies;
+};
+
+long HeavyValue::copies = 0;
+
+
+enum HeavyInsert {
+	HEAVY_INSERT = 0,
+	HEAVY_INSERT_OR_ASSIGN,
+	HEAVY_TRY_EMPLACE
+};
+
+
+// Fills a cache with 4 KB values by copy, by move and built in place, and
+// reports the time taken and the number of payload copies for each
+void test_heavy_values(const TestParams & params)
+{
+	static const char * names[] = { "insert", "insert_or_assign", "try_emplace" };
+	const size_t payload = 4096;
+
+	cerr << "-------------------------------------" << endl;
+	cerr << params.name() << " (" << payload << " byte values)" << endl;
+	for (int how = HEAVY_INSERT;  how <= HEAVY_TRY_EMPLACE;  ++how) {
+		plb::LRUCacheH4<int, HeavyValue> cache(params.cache_size);
+		srand(171);
+		HeavyValue::copies = 0;
+		boost::timer t;
+
+		for (int i = 0;  i < params.insertions;  ++i) {
+			const int key = rand() % params.num_keys;
+			if (how == HEAVY_INSERT)
+				cache.insert(key, HeavyValue(payload, char(key)));
+			else if (how == HEAVY_INSERT_OR_ASSIGN)
+				cache.insert_or_assign(key, HeavyValue(payload, char(key)));
+			else
+				cache.try_emplace(key, payload, char(key));
+		}
+
+		double elapsed = t.elapsed();
+		cerr << names[how] << ": elapsed: " << elapsed
+		     << ", rate: " << (elapsed > 0.0 ? params.insertions / elapsed : 0.0)
+		     << ", copies: " << HeavyValue::copies << endl;
+	}
+}
+
+
+// Looks up random keys in batches of 1, 16 and 128 with multi_get(), and
+// inserts the misses of each batch with multi_put()
+void test_batches(const TestParams & params)
+{
+	static const int batch_sizes[] = { 1, 16, 128 };
+
+	cerr << "-------------------------------------" << endl;
+	cerr << params.name() << endl;
+	for (int b = 0;  b < 3;  ++b) {
+		const int batch = batch_sizes[b];
+		plb::LRUCacheH4<int, int> cache(params.cache_size);
+		vector<int> keys(batch), misses, values;
+		vector<plb::LRUCacheH4<int, int>::const_iterator> found(batch);
+		srand(171);
+		long hits = 0;
+		boost::timer t;
+
+		for (int i = 0;  i < params.insertions;  i += batch) {
+			const int n = min(batch, params.insertions - i);
+			for (int j = 0;  j < n;  ++j)
+				keys[j] = rand() % params.num_keys;
+
+			hits += cache.multi_get(&keys[0], n, &found[0]);
+			misses.clear();
+			values.clear();
+			for (int j = 0;  j < n;  ++j) {
+				if (found[j] == cache.end()) {
+					misses.push_back(keys[j]);
+					values.push_back(keys[j]);
+				}
+			}
+			if (!misses.empty())
+				cache.multi_put(&misses[0], &values[0], misses.size());
+		}
+
+		double elapsed = t.elapsed();
+		cerr << "batch " << batch << ": elapsed: " << elapsed
+		     << ", rate: " << (elapsed > 0.0 ? params.insertions / elapsed : 0.0)
+		     << ", hit ratio: " << (params.insertions > 0 ? double(hits) / params.insertions : 0.0) << endl;
+	}
+}
+
+
+// Time to save a full cache and to load it back into an empty one
+void test_snapshot(const TestParams & params)
+{
+	const string path = "/tmp/lru_comp_snapshot.bin";
+	plb::LRUCacheH4<int, int> cache(params.cache_size);
+	for (int i = 0;  i < params.cache_size;  ++i)
+		cache.insert(i, i);
+
+	cerr << "-------------------------------------" << endl;
+	cerr << params.name() << endl;
+	boost::timer t;
+	plb::save_snapshot(cache, path);
+	cerr << "save: elapsed: " << t.elapsed() << endl;
+
+	plb::LRUCacheH4<int, int> restored(params.cache_size);
+	t.restart();
+	int loaded = plb::load_snapshot(restored, path);
+	cerr << "load: elapsed: " << t.elapsed() << ", entries: " << loaded << endl;
+	remove(path.c_str());
+}
+
+
+// Runs the random keys through a cache, then through a miss ratio curve
+// estimator alone: reports the cost of the estimator relative to the cache,
+// and the estimated hit ratios next to the one measured for the cache size
+void test_mrc(const TestParams & params, double rate)
+{
+	cerr << "-------------------------------------" << endl;
+	cerr << params.name() << " (sampling rate " << rate << ")" << endl;
+	plb::LRUCacheH4<int, int> cache(params.cache_size);
+	srand(171);
+	long hits = 0;
+	boost::timer t;
+	for (int i = 0;  i < params.insertions;  ++i) {
+		const int key = rand() % params.num_keys;
+		if (cache.find(key) != cache.end())
+			++hits;
+		else
+			cache.insert(key, key);
+	}
+	const double elapsed = t.elapsed();
+
+	// the keys alone, to take their generation out of the estimator's time
+	srand(171);
+	t.restart();
+	for (int i = 0;  i < params.insertions;  ++i)
+		rand();
+	const double keys_elapsed = t.elapsed();
+
+	plb::MissRatioCurve<int> mrc(rate, 2 * params.cache_size, 8);
+	srand(171);
+	t.restart();
+	for (int i = 0;  i < params.insertions;  ++i)
+		mrc.access(rand() % params.num_keys);
+	const double mrc_elapsed = max(t.elapsed() - keys_elapsed, 0.0);
+
+	cerr << "elapsed: " << elapsed << ", estimator: " << mrc_elapsed
+	     << ", overhead: " << (elapsed > 0.0 ? 100.0 * mrc_elapsed / elapsed : 0.0) << "%" << endl;
+	cerr << "hit ratio: " << (params.insertions > 0 ? double(hits) / params.insertions : 0.0)
+	     << ", estimated: " << mrc.hit_ratio(params.cache_size) << endl;
+	mrc.dump(cerr);
+}
+
+
+// Replays a binary trace through both the PLB and the PA caches, with the
+// same values: ops/sec and hit ratios are for the same traffic
+void test_trace(const string & path, int cache_size)
+{
+	plb::trace_file trace;
+	if (!trace.open(path)) {
+		cerr << path << ": not a trace" << endl;
+		return;
+	}
+	
+	TestParams params(cache_size, 0, trace.records(), false);
+	params.trace = &trace;
+	cerr << "-------------------------------------" << endl;
+	cerr << path << ": " << trace.records() << " records, cache size " << cache_size << endl;
+	params.show_header = false;
+	
+	cerr << "PLB" << endl;
+	TestDriverPLB<uint64_t, int> plb(params);
+	plb.do_test(TEST_CASE_REPLAY);
+	
+	cerr << "PA" << endl;
+	TestDriverPA<uint64_t, int> pa(params);
+	pa.do_test(TEST_CASE_REPLAY);
+}
+
+
+// A cache shared by the threads of test_scaling(): get() looks a key up and
+// updates the MRU, put() inserts
+struct ConcurrentDriver
+{
+	virtual ~ConcurrentDriver()
+	{
+	}
+	
+	virtual string name() const = 0;
+	virtual bool get(int key) = 0;
+	virtual void put(int key, int value) = 0;
+};
+
+
+// Locked by boost::mutex when built with _REENTRANT (-pthread)
+struct ConcurrentDriverPA : public ConcurrentDriver
+{
+	ConcurrentDriverPA(int cache_size) : cache(cache_size)
+	{
+	}
+	
+	virtual string name() const
+	{
+		return "PA";
+	}
+	
+	virtual bool get(int key)
+	{
+		int value;
+		return cache.fetch(key, value);
+	}
+	
+	virtual void put(int key, int value)
+	{
+		cache.insert(key, value);
+	}
+	
+	LRUCache<int, int> cache;
+};
+
+
+// One lock around the whole cache: the baseline for the sharded cache
+struct ConcurrentDriverPLB : public ConcurrentDriver
+{
+	ConcurrentDriverPLB(int cache_size) : cache(cache_size)
+	{
+	}
+	
+	virtual string name() const
+	{
+		return "PLB + mutex";
+	}
+	
+	virtual bool get(int key)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return cache.find(key) != cache.end();
+	}
+	
+	virtual void put(int key, int value)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		cache.insert(key, value);
+	}
+	
+	std::mutex mutex;
+	plb::LRUCacheH4<int, int> cache;
+};
+
+
+struct ConcurrentDriverSharded : public ConcurrentDriver
+{
+	ConcurrentDriverSharded(int cache_size) : cache(cache_size, min(cache_size, 16))
+	{
+	}
+	
+	virtual string name() const
+	{
+		return "PLB sharded " + boost::lexical_cast<string>(cache.shards());
+	}
+	
+	virtual bool get(int key)
+	{
+		int value;
+		return cache.find(key, value);
+	}
+	
+	virtual void put(int key, int value)
+	{
+		cache.insert(key, value);
+	}
+	
+	plb::LRUCacheH4Sharded<int, int> cache;
+};
+
+
+// Approximate LRU: hits take no lock, misses take the writers' mutex
+struct ConcurrentDriverClock : public ConcurrentDriver
+{
+	ConcurrentDriverClock(int cache_size) : cache(cache_size)
+	{
+	}
+	
+	virtual string name() const
+	{
+		return "PLB CLOCK";
+	}
+	
+	virtual bool get(int key)
+	{
+		int value;
+		return cache.find(key, value);
+	}
+	
+	virtual void put(int key, int value)
+	{
+		cache.insert(key, value);
+	}
+	
+	plb::ClockCache<int, int> cache;
+};
+
+
+struct ScalingParams
+{
+	ScalingParams() : max_threads(max(int(std::thread::hardware_concurrency()), 1)), read_percent(90), duration_ms(1000)
+	{
+	}
+	
+	int max_threads;
+	int read_percent;       // the other operations insert
+	int duration_ms;        // for each thread count
+};
+
+
+// What one thread did; a cache line each so the counters do not false-share
+struct alignas(64) ThreadResult
+{
+	ThreadResult() : ops(0), reads(0), hits(0)
+	{
+	}
+	
+	long ops;
+	long reads;
+	long hits;
+};
+
+
+// Thread i runs on CPU i modulo the number of CPUs
+void pin_thread(std::thread & thread, int i)
+{
+	const int cpus = max(int(std::thread::hardware_concurrency()), 1);
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(i % cpus, &set);
+	pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+}
+
+
+// Each thread draws keys from its own generator, seeded by its index, and
+// runs until the time is up; a read that misses inserts the key, as in
+// TEST_CASE_INSERT_READ. The time is wall clock: boost::timer is CPU time,
+// summed over the threads.
+void run_threads(ConcurrentDriver & cache, const TestParams & params, const ScalingParams & scaling,
+                 int threads, vector<ThreadResult> & results, double & elapsed)
+{
+	std::atomic<int> ready(0);
+	std::atomic<bool> start(false), stop(false);
+	vector<std::thread> workers;
+	results.assign(threads, ThreadResult());
+	
+	for (int i = 0;  i < threads;  ++i) {
+		workers.push_back(std::thread([&, i]() {
+			std::unique_ptr<plb::key_generator> keys(make_keys(params, 171 + i));
+			plb::fast_rand mix(~uint64_t(i));
+			ThreadResult & result = results[i];
+			++ready;
+			while (!start.load(std::memory_order_acquire))
+				std::this_thread::yield();
+			
+			while (!stop.load(std::memory_order_relaxed)) {
+				for (int n = 0;  n < 64;  ++n) {
+					const int key = keys->next();
+					if (int(mix.below(100)) < scaling.read_percent) {
+						++result.reads;
+						if (cache.get(key))
+							++result.hits;
+						else
+							cache.put(key, key);
+					}
+					else {
+						cache.put(key, key);
+					}
+				}
+				result.ops += 64;
+			}
+		}));
+		pin_thread(workers.back(), i);
+	}
+	
+	while (ready < threads)
+		std::this_thread::yield();
+	const std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	start.store(true, std::memory_order_release);
+	std::this_thread::sleep_for(std::chrono::milliseconds(scaling.duration_ms));
+	stop = true;
+	for (int i = 0;  i < threads;  ++i)
+		workers[i].join();
+	elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+
+// A scaling table for each cache: aggregate ops/sec and speedup over one
+// thread, then how evenly the threads were served: Jain's fairness index,
+// 1 when all did as many operations, 1/n when one did them all, and the
+// fewest and most operations a thread did
+void test_scaling(const TestParams & test, const ScalingParams & scaling)
+{
+	// rand() is not thread-safe: its keys are drawn uniformly by each thread
+	TestParams params = test;
+	if (params.workload == WORKLOAD_RAND)
+		params.workload = WORKLOAD_UNIFORM;
+	
+	cerr << "-------------------------------------" << endl;
+	cerr << params.name() << ": " << scaling.read_percent << "% reads, "
+	     << scaling.duration_ms << " ms per thread count" << endl;
+	
+	for (int c = 0;  c < 4;  ++c) {
+		std::unique_ptr<ConcurrentDriver> cache(
+			c == 0 ? static_cast<ConcurrentDriver *>(new ConcurrentDriverPA(params.cache_size)) :
+			c == 1 ? static_cast<ConcurrentDriver *>(new ConcurrentDriverPLB(params.cache_size)) :
+			c == 2 ? static_cast<ConcurrentDriver *>(new ConcurrentDriverSharded(params.cache_size)) :
+			static_cast<ConcurrentDriver *>(new ConcurrentDriverClock(params.cache_size)));
+#ifndef _REENTRANT
+		if (c == 0) {
+			cerr << cache->name() << ": not thread-safe without _REENTRANT" << endl;
+			continue;
+		}
+#endif
+		cerr << cache->name() << endl;
+		
+		// warm, so that one thread does not pay for filling the cache
+		std::unique_ptr<plb::key_generator> keys(make_keys(params, 0));
+		for (int i = 0;  i < params.cache_size;  ++i) {
+			const int key = keys->next();
+			cache->put(key, key);
+		}
+		
+		double base_rate = 0.0;
+		for (int threads = 1;  threads <= scaling.max_threads;  ++threads) {
+			vector<ThreadResult> results;
+			double elapsed = 0.0;
+			run_threads(*cache, params, scaling, threads, results, elapsed);
+			
+			long ops = 0, reads = 0, hits = 0, fewest = results[0].ops, most = results[0].ops;
+			double squares = 0.0;
+			for (int i = 0;  i < threads;  ++i) {
+				ops += results[i].ops;
+				reads += results[i].reads;
+				hits += results[i].hits;
+				fewest = min(fewest, results[i].ops);
+				most = max(most, results[i].ops);
+				squares += double(results[i].ops) * results[i].ops;
+			}
+			
+			const double rate = elapsed > 0.0 ? ops / elapsed : 0.0;
+			if (threads == 1)
+				base_rate = rate;
+			cerr << "threads: " << threads
+			     << ", rate: " << rate
+			     << ", speedup: " << (base_rate > 0.0 ? rate / base_rate : 0.0)
+			     << ", hit ratio: " << (reads > 0 ? double(hits) / reads : 0.0)
+			     << ", fairness: " << (squares > 0.0 ? double(ops) * ops / (threads * squares) : 0.0)
+			     << ", ops/thread: " << fewest << "-" << most << endl;
+		}
+	}
+}
+
+
 enum Action {
 	RUN_PLB = 0,
 	RUN_PA = 1,
-	CORRECTNESS = 2
+	CORRECTNESS = 2,
+	RUN_FLAT = 3,
+	RUN_ARC = 4,
+	RUN_TINYLFU = 5,
+	RUN_HEAVY = 6,
+	RUN_BATCH = 7,
+	RUN_SNAPSHOT = 8,
+	RUN_MRC = 9,
+	RUN_TRACE = 10,
+	CONVERT_TRACE = 11,
+	RUN_SCALING = 12
 };
 
 
@@ -324,6 +1051,16 @@ ostream & operator<<(ostream & os, const Action & a)
 	return os << (a == RUN_PLB ? "RUN_PLB" :
 		          a == RUN_PA ? "RUN_PA" :
 		          a == CORRECTNESS ? "CORRECTNESS" :
+		          a == RUN_FLAT ? "RUN_FLAT" :
+		          a == RUN_ARC ? "RUN_ARC" :
+		          a == RUN_TINYLFU ? "RUN_TINYLFU" :
+		          a == RUN_HEAVY ? "RUN_HEAVY" :
+		          a == RUN_BATCH ? "RUN_BATCH" :
+		          a == RUN_SNAPSHOT ? "RUN_SNAPSHOT" :
+		          a == RUN_MRC ? "RUN_MRC" :
+		          a == RUN_TRACE ? "RUN_TRACE" :
+		          a == CONVERT_TRACE ? "CONVERT_TRACE" :
+		          a == RUN_SCALING ? "RUN_SCALING" :
 		          "ACTION_UNKNOWN");
 }
 
@@ -332,17 +1069,59 @@ int main(int argc, char ** argv)
 {
 	TestCase tc = TEST_CASE_INSERT;
 	Action action = CORRECTNESS;
+	string trace_path, text_path;
+	int trace_cache_size = 0;
+	bool tc_given = false;
+	Workload workload = WORKLOAD_RAND;
+	double skew = 0.99;
+	ScalingParams scaling;
 	
 	for (int i = 1;  i < argc;  ++i) {
 		string a = argv[i];
 		if (a == "RUN_PLB") action = RUN_PLB;
 		else if (a == "RUN_PA") action = RUN_PA;
 		else if (a == "CORRECTNESS") action = CORRECTNESS;
-		else if (a == "TEST_CASE_INSERT") tc = TEST_CASE_INSERT;
-		else if (a == "TEST_CASE_INSERT_READ") tc = TEST_CASE_INSERT_READ;
+		else if (a == "RUN_FLAT") action = RUN_FLAT;
+		else if (a == "RUN_ARC") action = RUN_ARC;
+		else if (a == "RUN_TINYLFU") action = RUN_TINYLFU;
+		else if (a == "RUN_HEAVY") action = RUN_HEAVY;
+		else if (a == "RUN_BATCH") action = RUN_BATCH;
+		else if (a == "RUN_SNAPSHOT") action = RUN_SNAPSHOT;
+		else if (a == "RUN_MRC") action = RUN_MRC;
+		else if (a == "RUN_TRACE" && i + 2 < argc) {
+			// RUN_TRACE <trace> <cache size>
+			action = RUN_TRACE;
+			trace_path = argv[++i];
+			trace_cache_size = boost::lexical_cast<int>(argv[++i]);
+		}
+		else if (a == "CONVERT_TRACE" && i + 2 < argc) {
+			// CONVERT_TRACE <text log> <trace>
+			action = CONVERT_TRACE;
+			text_path = argv[++i];
+			trace_path = argv[++i];
+		}
+		else if (a == "RUN_SCALING") action = RUN_SCALING;
+		else if (a.compare(0, 8, "THREADS=") == 0) scaling.max_threads = boost::lexical_cast<int>(a.substr(8));
+		else if (a.compare(0, 6, "READS=") == 0) scaling.read_percent = boost::lexical_cast<int>(a.substr(6));
+		else if (a.compare(0, 9, "DURATION=") == 0) scaling.duration_ms = boost::lexical_cast<int>(a.substr(9));
+		else if (a == "UNIFORM") workload = WORKLOAD_UNIFORM;
+		else if (a == "ZIPF") workload = WORKLOAD_ZIPF;
+		else if (a.compare(0, 5, "ZIPF=") == 0) {
+			workload = WORKLOAD_ZIPF;
+			skew = boost::lexical_cast<double>(a.substr(5));
+		}
+		else if (a == "SCAN") workload = WORKLOAD_SCAN;
+		else if (a == "DRIFT") workload = WORKLOAD_DRIFT;
+		else if (a == "LOOP") workload = WORKLOAD_LOOP;
+		else if (a == "TEST_CASE_INSERT") tc = TEST_CASE_INSERT, tc_given = true;
+		else if (a == "TEST_CASE_INSERT_READ") tc = TEST_CASE_INSERT_READ, tc_given = true;
 		else cerr << "Unrecognized option: " << a << endl;
 	}
 	
+	// hits are what a key distribution is about
+	if (workload != WORKLOAD_RAND && !tc_given)
+		tc = TEST_CASE_INSERT_READ;
+	
 	cerr << "tc: " << tc << endl;
 	cerr << "action: " << action << endl;
 	
@@ -358,6 +1137,10 @@ int main(int argc, char ** argv)
 			(TestParams(2000000, 20000000, 20000000))
 			(TestParams(3000000, 30000000, 30000000));
 			(TestParams(5000000, 50000000, 50000000));
+	for (int i = 0;  i < tests.size();  ++i) {
+		tests[i].workload = workload;
+		tests[i].skew = skew;
+	}
 	
 	if (action == RUN_PLB) {
 		// cpu time + memory usage of PLB cache
@@ -377,6 +1160,89 @@ int main(int argc, char ** argv)
 		}
 	}
 	
+	else if (action == RUN_FLAT) {
+		// cpu time + memory usage of the flat PLB cache
+		show_memory_usage();
+		for (int i = 0;  i < tests.size();  ++i) {
+			TestDriverFlat<int, int> driver(tests[i]);
+			driver.do_test(tc);
+		}
+	}
+	
+	else if (action == RUN_ARC) {
+		// cpu time + memory usage of the ARC cache; compare hit ratios with
+		// RUN_PLB on TEST_CASE_INSERT_READ
+		show_memory_usage();
+		for (int i = 0;  i < tests.size();  ++i) {
+			TestDriverARC<int, int> driver(tests[i]);
+			driver.do_test(tc);
+		}
+	}
+	
+	else if (action == RUN_TINYLFU) {
+		// cpu time + memory usage of the W-TinyLFU cache
+		show_memory_usage();
+		for (int i = 0;  i < tests.size();  ++i) {
+			TestDriverTinyLFU<int, int> driver(tests[i]);
+			driver.do_test(tc);
+		}
+	}
+	
+	else if (action == RUN_HEAVY) {
+		// copies of large values made by insert() vs insert_or_assign() vs
+		// try_emplace(); the big test cases would take gigabytes
+		for (int i = 0;  i < tests.size();  ++i) {
+			if (tests[i].cache_size <= 1000)
+				test_heavy_values(tests[i]);
+		}
+	}
+	
+	else if (action == RUN_BATCH) {
+		// multi_get() and multi_put() with batches of 1, 16 and 128 keys:
+		// prefetching pays off once the cache outgrows the CPU caches
+		for (int i = 0;  i < tests.size();  ++i)
+			test_batches(tests[i]);
+	}
+	
+	else if (action == RUN_SNAPSHOT) {
+		// warm restart: save a full cache, load it back
+		for (int i = 0;  i < tests.size();  ++i)
+			test_snapshot(tests[i]);
+	}
+	
+	else if (action == RUN_MRC) {
+		// hit ratio vs cache size, estimated online from a sample of the keys:
+		// the larger the key set, the smaller the sample it takes
+		for (int i = 0;  i < tests.size();  ++i) {
+			const int num_keys = tests[i].num_keys;
+			test_mrc(tests[i], num_keys < 100000 ? 1.0 : num_keys < 10000000 ? 0.01 : 0.001);
+		}
+	}
+	
+	else if (action == RUN_TRACE) {
+		// recorded traffic instead of random keys
+		test_trace(trace_path, trace_cache_size);
+	}
+	
+	else if (action == CONVERT_TRACE) {
+		long clamped = 0;
+		long records = plb::convert_trace(text_path, trace_path, &clamped);
+		if (records < 0) {
+			cerr << "cannot convert " << text_path << " to " << trace_path << endl;
+			return 1;
+		}
+		cerr << trace_path << ": " << records << " records" << endl;
+		if (clamped)
+			cerr << "warning: " << clamped << " sizes of 4 GiB or more clamped to 4 GiB - 1" << endl;
+	}
+	
+	else if (action == RUN_SCALING) {
+		// 1 to THREADS threads on one cache: contention shows as a rate that
+		// stops growing, or threads served unevenly
+		for (int i = 0;  i < tests.size();  ++i)
+			test_scaling(tests[i], scaling);
+	}
+	
 	else if (action == CORRECTNESS) {
 		// make sure all caches give the same sequence
 		for (int i = 0;  i < tests.size();  ++i) {
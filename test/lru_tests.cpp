@@ -2,18 +2,82 @@
 // Test cases
 //-------------------------------------------------------------
 
+// The tests run with the statistics on
+#define PLB_LRU_STATS
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
+#include <map>
+#include <new>
+#include <stdexcept>
+#include <string>
 #include <memory>
 #include <vector>
+#include <thread>
 #include <boost/assign/list_of.hpp>
-#include "lru.hpp"
+#include "../lru.hpp"
+#include "../lru_sharded.hpp"
+#include "../lru_clock.hpp"
+#include "../lru_flat.hpp"
+#include "../lru_arc.hpp"
+#include "../lru_tinylfu.hpp"
+#include "../lru_refresh.hpp"
+#include "../lru_writeback.hpp"
+#include "../lru_snapshot.hpp"
+#include "../lru_hybrid.hpp"
+#include "../lru_shm.hpp"
+#include "../lru_mrc.hpp"
+#include "../lru_tagged.hpp"
 
 using namespace plb;
 
+// Counts heap allocations, to check that the pooled cache does not allocate
+static long allocations = 0;
+
+void * operator new(std::size_t size)
+{
+	++allocations;
+	void * p = std::malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void * p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void * p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+// The array forms too: new[] and delete[] must pair with the same allocator
+void * operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete[](void * p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void * p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
 // See test functions below on how to use this struct
-template<class K, class V>
+template<class K, class V, class C = LRUCacheH4<K, V> >
 struct LRUCacheH4TestCase {
-	typedef LRUCacheH4<K, V> Cache;
+	typedef C Cache;
 	typedef std::pair<K, V> Pair;
 	typedef std::vector<Pair> Vector;
 	
@@ -214,6 +278,1198 @@ std::auto_ptr<LRUCacheH4TestCaseII> T15()
 	return tc;
 }
 
+// For tests that check a property rather than an MRU to LRU sequence
+bool test(bool ret)
+{
+	std::cerr << "test: " << ret << std::endl;
+	return ret;
+}
+
+bool T16()
+{
+	// sharded: every key lands in one shard, shards evict independently
+	LRUCacheH4Sharded<int, int> c(64, 4);
+	for (int i = 0;  i < 1000;  ++i)
+		c.insert(i, i + 100);
+
+	bool ret = c.size() == 64 && c.maxsize() == 64 && c.shards() == 4;
+	for (int i = 0;  i < c.shards();  ++i)
+		ret = ret && c.shard_size(i) == c.shard_maxsize(i);
+
+	int v = 0;
+	ret = ret && c.find(999, v) && v == 1099 && c[999] == 1099;
+
+	const LRUCacheH4Sharded<int, int> & cc = c;
+	ret = ret && cc.find(998, v) && v == 1098 && !cc.find(0, v);
+	return test(ret);
+}
+
+bool T17()
+{
+	// sharded: concurrent writers and readers on overlapping keys
+	LRUCacheH4Sharded<int, int> c(1000, 8);
+	std::vector<std::thread> threads;
+	for (int t = 0;  t < 8;  ++t)
+		threads.push_back(std::thread([&c, t]() {
+			for (int i = 0;  i < 20000;  ++i) {
+				int v;
+				if (!c.find((i * 7 + t) % 1500, v))
+					c.insert((i * 7 + t) % 1500, i);
+			}
+		}));
+	for (int t = 0;  t < 8;  ++t)
+		threads[t].join();
+	return test(c.size() <= 1000 && c.size() > 0);
+}
+
+bool T18()
+{
+	// clock: a referenced entry gets a second chance, the next one is evicted
+	ClockCache<int, int> c(3);
+	c.insert(1, 101);
+	c.insert(2, 102);
+	c.insert(3, 103);
+	int v = 0;
+	bool ret = c.find(1, v) && v == 101;
+	c.insert(4, 104);
+	ret = ret && c.contains(1) && !c.contains(2) && c.contains(3) && c.contains(4);
+	c.insert(5, 105);
+	ret = ret && c.contains(1) && !c.contains(3) && c.size() == 3;
+	return test(ret);
+}
+
+bool T19()
+{
+	// clock: concurrent readers on a hot set while a writer churns the cold keys
+	ClockCache<int, int> c(100);
+	for (int i = 0;  i < 50;  ++i)
+		c.insert(i, i);
+
+	std::vector<std::thread> threads;
+	bool ok[4] = { true, true, true, true };
+	for (int t = 0;  t < 4;  ++t)
+		threads.push_back(std::thread([&c, &ok, t]() {
+			for (int i = 0;  i < 50000;  ++i) {
+				int v;
+				if (c.find(i % 50, v) && v != i % 50)
+					ok[t] = false;
+			}
+		}));
+	for (int i = 0;  i < 50000;  ++i)
+		c.insert(1000 + i, i);
+	for (int t = 0;  t < 4;  ++t)
+		threads[t].join();
+	return test(ok[0] && ok[1] && ok[2] && ok[3] && c.size() == 100);
+}
+
+std::auto_ptr<LRUCacheH4TestCase<int, int, LRUCacheFlat<int, int> > > T20()
+{
+	// flat: cache full, updating lru, updating middle, inserting new
+	std::auto_ptr<LRUCacheH4TestCase<int, int, LRUCacheFlat<int, int> > > tc(
+		new LRUCacheH4TestCase<int, int, LRUCacheFlat<int, int> >(3));
+	tc->_cache.insert(1, 101);
+	tc->_cache.insert(2, 102);
+	tc->_cache.insert(3, 103);
+	tc->_cache.insert(1, 1001);
+	tc->_cache.insert(3, 1003);
+	tc->_cache.insert(4, 104);
+	tc->_expected = boost::assign::list_of<PairII>(PairII(4, 104))(PairII(3, 1003))(PairII(1, 1001));
+	return tc;
+}
+
+bool T21()
+{
+	// flat: same MRU to LRU sequence as LRUCacheH4 under random churn,
+	// with colliding keys to exercise the index deletions
+	LRUCacheH4TestCaseII h4(37);
+	LRUCacheH4TestCase<int, int, LRUCacheFlat<int, int> > flat(37);
+	srand(17);
+	for (int i = 0;  i < 100000;  ++i) {
+		int key = (rand() % 100) * 64;
+		if (rand() % 2) {
+			h4._cache.insert(key, i);
+			flat._cache.insert(key, i);
+		}
+		else {
+			h4._cache.find(key);
+			flat._cache.find(key);
+		}
+	}
+	return test(h4.vector_mru_to_lru(h4._cache) == flat.vector_mru_to_lru(flat._cache));
+}
+
+bool T22()
+{
+	// pooled: same sequence as the default mode, no allocation once constructed
+	LRUCacheH4<int, int> c(100, true);
+	LRUCacheH4TestCaseII expected(100);
+	const long before = allocations;
+	for (int i = 0;  i < 100000;  ++i)
+		c.insert((i * 7919) % 250, i);
+	bool ret = allocations - before == 0 && c.pooled() && c.size() == 100;
+	
+	for (int i = 0;  i < 100000;  ++i)
+		expected._cache.insert((i * 7919) % 250, i);
+	
+	LRUCacheH4<int, int> copy(c);
+	ret = ret && copy.pooled()
+	          && expected.vector_mru_to_lru(c) == expected.vector_mru_to_lru(expected._cache)
+	          && expected.vector_mru_to_lru(copy) == expected.vector_mru_to_lru(c);
+	return test(ret);
+}
+
+bool T23()
+{
+	// default mode: a full cache recycles the LRU node instead of reallocating
+	LRUCacheH4<int, int> c(10);
+	for (int i = 0;  i < 10;  ++i)
+		c.insert(i, i);
+	const long before = allocations;
+	for (int i = 10;  i < 1000;  ++i)
+		c.insert(i, i);
+	return test(allocations - before == 0 && c.size() == 10 && c.find(999) != c.end());
+}
+
+struct StringSize
+{
+	unsigned long operator()(const std::string & s) const { return s.size(); }
+};
+
+bool T24()
+{
+	// weighted: evict as many LRU entries as needed, never cache oversize values
+	typedef LRUCacheH4<int, std::string, StringSize> Cache;
+	Cache c(100, false, 10);
+	c.insert(1, "aaaa");
+	c.insert(2, "bbbb");
+	c.insert(3, "ccc");
+	bool ret = c.size() == 2 && c.weight() == 7 && c.maxweight() == 10 && c.find(1) == c.end();
+	
+	c.insert(4, "dddddddd");
+	ret = ret && c.size() == 1 && c.weight() == 8;
+	
+	c.insert(4, "dd");
+	c.insert(5, "eeeeeeee");
+	ret = ret && c.size() == 2 && c.weight() == 10;
+	
+	c.insert(5, "xxxxxxxxxxx");
+	ret = ret && c.size() == 1 && c.weight() == 2 && c.find(5) == c.end();
+	
+	Cache copy(c);
+	ret = ret && copy.weight() == 2 && copy.maxweight() == 10;
+	return test(ret);
+}
+
+bool T25()
+{
+	// weighted: the default weight counts entries
+	LRUCacheH4<int, int> c(3);
+	for (int i = 0;  i < 10;  ++i)
+		c[i] = i;
+	return test(c.weight() == 3 && c.maxweight() == 3 && c.size() == 3);
+}
+
+// Test clock for the expiry tests
+static uint32_t now = 0;
+
+uint32_t test_clock()
+{
+	return now;
+}
+
+bool T26()
+{
+	// ttl: expired entries are misses, per-entry TTLs override the default
+	LRUCacheH4<int, int> c(10);
+	c.set_clock(test_clock);
+	c.set_default_ttl(100);
+	now = 1000;
+	c.insert(1, 101);
+	c.insert(2, 102, 500);
+	c.insert(3, 103, 0);
+	now = 1050;
+	c[4] = 104;
+	bool ret = c.find(1) != c.end() && c.size() == 4;
+	
+	now = 1100;
+	const LRUCacheH4<int, int> & cc = c;
+	ret = ret && cc.find(1) == cc.end() && c.find(1) == c.end() && c.size() == 3;
+	
+	now = 1600;
+	ret = ret && c.expire() == 2 && c.size() == 1 && c.find(3) != c.end();
+	return test(ret);
+}
+
+bool T27()
+{
+	// ttl: expired entries are reclaimed before the LRU entry is evicted
+	LRUCacheH4<int, int> c(3);
+	c.set_clock(test_clock);
+	now = 5000;
+	c.insert(1, 101, 10);
+	c.insert(2, 102);
+	c.insert(3, 103);
+	c.find(1);
+	now = 5010;
+	c.insert(4, 104);
+	return test(c.size() == 3 && c.find(1) == c.end() && c.find(2) != c.end());
+}
+
+bool T28()
+{
+	// ttl: long TTLs cascade down the wheel, across the 32-bit wrap, and
+	// re-inserting a key replaces its expiry
+	LRUCacheH4<int, int> c(1000);
+	const LRUCacheH4<int, int> & cc = c;
+	c.set_clock(test_clock);
+	now = 0xFFFFF000;
+	for (int i = 0;  i < 500;  ++i)
+		c.insert(i, i, 1 + i * 7919);
+	c.insert(0, 0, 10000000);
+	
+	bool ret = true;
+	for (int step = 0;  step < 5000 && ret;  ++step) {
+		now += 997;
+		c.expire();
+		int live = 1;
+		for (int i = 1;  i < 500;  ++i) {
+			bool expected = int32_t(0xFFFFF000 + 1 + i * 7919 - now) > 0;
+			ret = ret && (cc.find(i) != cc.end()) == expected;
+			live += expected;
+		}
+		ret = ret && c.size() == live;
+	}
+	ret = ret && c.size() == 1 && c.find(0) != c.end();
+	now += 10000000;
+	return test(ret && c.expire() == 1 && c.size() == 0);
+}
+
+bool T29()
+{
+	// arc: entries seen twice survive a scan of one-off keys
+	ARCCache<int, int> c(4);
+	c.insert(1, 101);
+	c.insert(2, 102);
+	c.find(1);
+	c.find(2);
+	for (int i = 10;  i < 100;  ++i)
+		c.insert(i, i);
+	bool ret = c.find(1) != c.end() && c.find(2) != c.end() && c.size() == 4;
+	
+	int n = 0;
+	for (ARCCache<int, int>::const_iterator it = c.begin();  it != c.end();  ++it)
+		++n;
+	return test(ret && n == 4);
+}
+
+bool T30()
+{
+	// arc: sizes stay bounded and resident values stay current under churn
+	ARCCache<int, int> c(50);
+	std::map<int, int> expected;
+	bool ret = true;
+	srand(29);
+	for (int i = 0;  i < 200000 && ret;  ++i) {
+		int key = rand() % (i % 2 ? 80 : 400);
+		ARCCache<int, int>::const_iterator it = c.find(key);
+		if (it != c.end())
+			ret = it.value() == expected[key];
+		else
+			c.insert(key, expected[key] = i);
+		ret = ret && c.size() <= 50 && c.target() >= 0 && c.target() <= 50;
+	}
+	return test(ret && c.size() == 50);
+}
+
+bool T31()
+{
+	// sketch: estimates never undercount, saturate at 15 and are halved
+	CountMinSketch4<int> sketch(64);
+	for (int i = 0;  i < 5;  ++i)
+		sketch.increment(7);
+	for (int i = 0;  i < 40;  ++i)
+		sketch.increment(8);
+	bool ret = sketch.frequency(7) >= 5 && sketch.frequency(8) == 15 && sketch.frequency(9) <= 1;
+	
+	for (int i = 0;  i < sketch.sample_size();  ++i)
+		sketch.increment(1000 + i);
+	return test(ret && sketch.frequency(8) <= 7 && sketch.frequency(8) >= 3);
+}
+
+bool T32()
+{
+	// tinylfu: a scan of one-off keys interleaved with accesses to a hot set
+	// does not flush the hot set, as it would with LRU
+	TinyLFUCache<int, int> c(100);
+	LRUCacheH4<int, int> lru(100);
+	for (int i = 0;  i < 20000;  ++i) {
+		int key = i % 2 ? 1000 + i : (i / 2) % 80;
+		if (c.find(key) == c.end())
+			c.insert(key, key);
+		if (lru.find(key) == lru.end())
+			lru.insert(key, key);
+	}
+	
+	const TinyLFUCache<int, int> & cc = c;
+	const LRUCacheH4<int, int> & clru = lru;
+	int hot = 0, lru_hot = 0;
+	for (int i = 0;  i < 80;  ++i) {
+		hot += cc.find(i) != cc.end() && cc.find(i).value() == i;
+		lru_hot += clru.find(i) != clru.end();
+	}
+	return test(hot >= 75 && lru_hot < 75 && c.size() == 100 && c.window_size() == 1);
+}
+
+bool T33()
+{
+	// string keys: lookups by string_view or C string do not build a string
+	LRUCacheH4<std::string, int> c(10);
+	const std::string key = "a key too long for the small string optimization";
+	c.insert(key, 1);
+	c.insert("another key too long for the small string optimization", 2);
+	
+	const long before = allocations;
+	std::string_view view(key);
+	bool ret = c.find(view) != c.end() && c.find(view).value() == 1;
+	ret = ret && c.contains(view) && !c.contains(std::string_view("missing"));
+	ret = ret && c["another key too long for the small string optimization"] == 2;
+	ret = ret && c.erase(view) && !c.erase(view);
+	ret = ret && allocations - before == 0 && c.size() == 1;
+	
+	c[std::string_view("a third key, this one built on insertion, no earlier")] = 3;
+	return test(ret && c.size() == 2 && c.find(std::string("a third key, this one built on insertion, no earlier")).value() == 3);
+}
+
+bool T34()
+{
+	// erase: unlinks from anywhere in the recency list
+	LRUCacheH4TestCaseII tc(4);
+	tc._cache.insert(1, 101);
+	tc._cache.insert(2, 102);
+	tc._cache.insert(3, 103);
+	tc._cache.insert(4, 104);
+	bool ret = tc._cache.erase(1) && tc._cache.erase(4) && tc._cache.erase(2) && !tc._cache.erase(5);
+	tc._cache.insert(5, 105);
+	tc._cache.insert(6, 106);
+	tc._expected = boost::assign::list_of<PairII>(PairII(6, 106))(PairII(5, 105))(PairII(3, 103));
+	return test(ret && tc._expected == tc.vector_mru_to_lru(tc._cache) && !tc._cache.contains(2));
+}
+
+// A value that counts how often it is copied and moved
+struct Counted
+{
+	Counted() : _data() { }
+	Counted(size_t n, char c) : _data(n, c) { }
+	Counted(const Counted & other) : _data(other._data) { ++copies; }
+	Counted(Counted && other) : _data(std::move(other._data)) { ++moves; }
+	Counted & operator=(const Counted & other) { _data = other._data; ++copies; return *this; }
+	Counted & operator=(Counted && other) { _data = std::move(other._data); ++moves; return *this; }
+	
+	std::vector<char> _data;
+	static int copies;
+	static int moves;
+};
+
+int Counted::copies = 0;
+int Counted::moves = 0;
+
+bool T35()
+{
+	// emplace: values are built in place, moved at most once, never copied
+	LRUCacheH4<int, Counted> c(2);
+	bool ret = c.try_emplace(1, 4096, 'a').second;
+	ret = ret && !c.try_emplace(1, 16, 'b').second && c.find(1).value()._data.size() == 4096;
+	ret = ret && c.emplace(2, 8, 'c').second;
+	
+	Counted v(1024, 'd');
+	ret = ret && c.insert_or_assign(3, std::move(v)).second && Counted::moves == 1;
+	ret = ret && c.insert_or_assign(3, Counted(512, 'e')).second && Counted::moves == 2;
+	c[4]._data.assign(10, 'f');
+	ret = ret && Counted::copies == 0 && c.size() == 2;
+	
+	// insert() copies once, into the node
+	c.insert(5, Counted(1, 'g'));
+	ret = ret && Counted::copies == 1 && c.find(5).value()._data.size() == 1;
+	return test(ret && c.find(4) != c.end() && c.find(3) == c.end());
+}
+
+bool T36()
+{
+	// emplace: string keys are moved into the node, heavy values are still weighed
+	LRUCacheH4<std::string, std::string, StringSize> c(10, false, 8);
+	std::string key = "a key too long for the small string optimization";
+	const char * data = key.data();
+	bool ret = c.try_emplace(std::move(key), 4, 'x').second && c.mru_begin().key().data() == data;
+	ret = ret && !c.insert_or_assign(std::string("k"), std::string(9, 'y')).second && c.size() == 1;
+	ret = ret && c.insert_or_assign(std::string("k"), std::string(5, 'y')).second && c.size() == 1 && c.weight() == 5;
+	return test(ret);
+}
+
+bool T37()
+{
+	// get_or_load: concurrent misses on one key run the loader once
+	LRUCacheH4Sharded<int, int> c(100, 4);
+	std::atomic<int> loads(0);
+	std::atomic<int> wrong(0);
+	std::vector<std::thread> threads;
+	for (int t = 0;  t < 16;  ++t)
+		threads.push_back(std::thread([&]() {
+			int v = c.get_or_load(7, [&](int key) {
+				++loads;
+				std::this_thread::sleep_for(std::chrono::milliseconds(50));
+				return key * 100;
+			});
+			if (v != 700)
+				++wrong;
+		}));
+	for (int t = 0;  t < 16;  ++t)
+		threads[t].join();
+	
+	int v = 0;
+	return test(loads == 1 && wrong == 0 && c.find(7, v) && v == 700 && c.size() == 1);
+}
+
+bool T38()
+{
+	// get_or_load: a loader exception reaches every waiter and is not cached
+	LRUCacheH4Sharded<int, int> c(100, 4);
+	std::atomic<int> loads(0);
+	std::atomic<int> failures(0);
+	std::atomic<int> callers(0);
+	std::vector<std::thread> threads;
+	for (int t = 0;  t < 8;  ++t)
+		threads.push_back(std::thread([&]() {
+			try {
+				++callers;
+				c.get_or_load(7, [&](int) -> int {
+					++loads;
+					while (callers < 8)
+						std::this_thread::yield();
+					std::this_thread::sleep_for(std::chrono::milliseconds(50));
+					throw std::runtime_error("backend down");
+				});
+			}
+			catch (const std::runtime_error &) {
+				++failures;
+			}
+		}));
+	for (int t = 0;  t < 8;  ++t)
+		threads[t].join();
+	
+	int v = 0;
+	bool ret = loads == 1 && failures == 8 && !c.find(7, v);
+	return test(ret && c.get_or_load(7, [](int key) { return key; }) == 7 && c.size() == 1);
+}
+
+bool T39()
+{
+	// refresh-ahead: a hit near expiry returns the current value and reloads it in the background
+	std::atomic<int> loads(0);
+	RefreshAheadCache<int, int> c(10, 1000, 200, [&](int key) { return key * 100 + ++loads; });
+	c.set_clock(test_clock);
+	now = 1000;
+	bool ret = c.get(1) == 101 && loads == 1;
+	
+	now = 1700;
+	ret = ret && c.get(1) == 101 && c.refreshes() == 0 && loads == 1;
+	now = 1850;
+	ret = ret && c.get(1) == 101;
+	for (int i = 0;  i < 1000 && c.refreshes() == 0;  ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	ret = ret && c.refreshes() == 1 && c.pending() == 0 && loads == 2;
+	
+	// the reload restarted the TTL: past the first expiry, still a hit
+	now = 2500;
+	int v = 0;
+	ret = ret && c.find(1, v) && v == 102 && c.get(1) == 102 && loads == 2;
+	
+	// an entry not read during its window expires and is loaded inline
+	now = 3000;
+	return test(ret && !c.find(1, v) && c.get(1) == 103 && loads == 3 && c.refreshes() == 1);
+}
+
+bool T40()
+{
+	// multi_get, multi_put: same hits, values and recency as a loop of find() and insert()
+	LRUCacheH4TestCaseII batched(50), looped(50);
+	std::vector<int> keys, values;
+	for (int i = 0;  i < 200;  ++i) {
+		keys.push_back((i * 37) % 70);
+		values.push_back(i);
+	}
+	batched._cache.multi_put(&keys[0], &values[0], 100);
+	for (int i = 0;  i < 100;  ++i)
+		looped._cache.insert(keys[i], values[i]);
+	
+	std::vector<LRUCacheH4<int, int>::const_iterator> found(200);
+	int hits = batched._cache.multi_get(&keys[50], 150, &found[0]);
+	bool ret = true;
+	int expected = 0;
+	for (int i = 0;  i < 150;  ++i) {
+		LRUCacheH4<int, int>::const_iterator it = looped._cache.find(keys[50 + i]);
+		if (it != looped._cache.end()) {
+			++expected;
+			ret = ret && found[i] != batched._cache.end() && found[i].value() == it.value();
+		}
+		else {
+			ret = ret && found[i] == batched._cache.end();
+		}
+	}
+	ret = ret && batched.vector_mru_to_lru(batched._cache) == looped.vector_mru_to_lru(looped._cache);
+	return test(ret && hits == expected && hits > 0 && hits < 150);
+}
+
+// Records the removals reported to a listener, as "key:value:cause"
+static std::vector<std::string> removals;
+
+void record_removal(const int & key, int & value, LRUCacheH4Removal cause)
+{
+	removals.push_back(std::to_string(key) + ":" + std::to_string(value) + ":" + std::to_string(int(cause)));
+}
+
+bool T41()
+{
+	// listener: evictions, erasures, replacements and expiries, with the old values
+	LRUCacheH4<int, int> c(2);
+	c.set_clock(test_clock);
+	now = 1000;
+	removals.clear();
+	c.set_listener(record_removal);
+	c.insert(1, 101);
+	c.insert(2, 102);
+	c.insert(3, 103);
+	c.insert(3, 113);
+	c.insert_or_assign(3, 123);
+	c.erase(3);
+	c.insert(4, 104, 10);
+	now = 1020;
+	bool ret = c.find(4) == c.end();
+	return test(ret && removals == boost::assign::list_of<std::string>
+		("1:101:0")("3:103:2")("3:113:2")("3:123:1")("4:104:3"));
+}
+
+bool T42()
+{
+	// listener: deferred removals move the values out, until delivered
+	LRUCacheH4<int, Counted> c(1);
+	int delivered = 0;
+	size_t bytes = 0;
+	c.set_listener([&](const int &, Counted & v, LRUCacheH4Removal) {
+		++delivered;
+		bytes += v._data.size();
+	}, true);
+	Counted::copies = 0;
+	c.try_emplace(1, 4096, 'a');
+	c.try_emplace(2, 4096, 'b');
+	c.try_emplace(3, 4096, 'c');
+	bool ret = delivered == 0 && c.deliver() == 2 && delivered == 2 && bytes == 8192;
+	
+	c.erase(3);
+	LRUCacheH4<int, Counted>::Removals taken;
+	c.take_removals(taken);
+	ret = ret && taken.size() == 1 && taken[0]._key == 3 && taken[0]._cause == LRU_ERASED;
+	return test(ret && taken[0]._v._data.size() == 4096 && Counted::copies == 0 && c.deliver() == 0);
+}
+
+bool T43()
+{
+	// sharded listener: runs outside the shard lock, so it may use the cache
+	LRUCacheH4Sharded<int, int> c(2, 1);
+	std::vector<int> evicted;
+	c.set_listener([&](const int & key, int &, LRUCacheH4Removal cause) {
+		if (cause == LRU_EVICTED && c.size() == 2)
+			evicted.push_back(key);
+	});
+	c.insert(1, 101);
+	c.insert(2, 102);
+	c[3];
+	c.get_or_load(4, [](int key) { return key; });
+	return test(evicted == boost::assign::list_of(1)(2));
+}
+
+bool T44()
+{
+	// write-back: writes coalesce, evicted dirty entries are written in batches
+	const char * path = "/tmp/lru_tests_writeback.txt";
+	std::remove(path);
+	FileBackingStore<int, int> store(path);
+	bool ret;
+	{
+		WriteBackCache<int, int> c(2, store, 2);
+		for (int i = 0;  i < 100;  ++i)
+			c.insert(1, i);
+		c.insert(2, 102);
+		c.insert(3, 103);
+		int v = 0;
+		ret = store.writes() == 0 && c.find(1, v) && v == 99 && c.dirty() == 3;
+		
+		c.insert(4, 104);
+		ret = ret && store.writes() == 2 && store.batches() == 1 && c.dirty() == 2;
+		ret = ret && c.flush() == 2 && store.writes() == 4 && c.dirty() == 0 && c.flush() == 0;
+		ret = ret && !c.find(1, v) && c.get(1, v) && v == 99 && !c.get(5, v);
+		c.insert(5, 105);
+	}
+	int v = 0;
+	return test(ret && store.read(5, v) && v == 105 && store.writes() == 5 && store.batches() == 3);
+}
+
+bool T45()
+{
+	// write-back: the background thread flushes dirty entries at each interval
+	const char * path = "/tmp/lru_tests_writeback_interval.txt";
+	std::remove(path);
+	FileBackingStore<int, int> store(path);
+	WriteBackCache<int, int> c(10, store, 64, 5);
+	c.insert(1, 101);
+	c.insert(1, 111);
+	for (int i = 0;  i < 1000 && store.writes() == 0;  ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	int v = 0;
+	return test(store.writes() == 1 && store.read(1, v) && v == 111 && c.dirty() == 0);
+}
+
+bool T46()
+{
+	// snapshot: a restored cache has the same entries in the same recency order
+	const char * path = "/tmp/lru_tests_snapshot.bin";
+	LRUCacheH4TestCaseII saved(100), restored(100);
+	for (int i = 0;  i < 150;  ++i)
+		saved._cache.insert(i, i + 1000);
+	for (int i = 60;  i < 150;  i += 7)
+		saved._cache.find(i);
+	save_snapshot(saved._cache, path);
+	
+	bool ret = load_snapshot(restored._cache, path) == 100;
+	return test(ret && restored.vector_mru_to_lru(restored._cache) == saved.vector_mru_to_lru(saved._cache));
+}
+
+bool T47()
+{
+	// snapshot: string entries; a smaller cache keeps the most recent; bad files throw
+	const char * path = "/tmp/lru_tests_snapshot_strings.bin";
+	LRUCacheH4<std::string, std::string> saved(10);
+	for (int i = 0;  i < 10;  ++i)
+		saved.insert("key " + std::to_string(i), std::string(i * 10, 'x'));
+	save_snapshot(saved, path);
+	
+	LRUCacheH4<std::string, std::string> restored(3);
+	bool ret = load_snapshot(restored, path) == 3 && restored.size() == 3;
+	ret = ret && restored.mru_begin().key() == "key 9" && restored.lru_begin().key() == "key 7";
+	ret = ret && restored.find("key 8").value() == std::string(80, 'x');
+	
+	LRUCacheH4<int, int> other(10);
+	try {
+		load_snapshot(other, path);
+		ret = false;
+	}
+	catch (const char *) {
+	}
+	return test(ret && other.size() == 0);
+}
+
+bool T48()
+{
+	// hybrid: evictions go to disk, disk hits come back to memory, old segments are reclaimed
+	HybridCache<int, std::string> c(2, "/tmp", 66, 2);
+	for (int i = 0;  i < 6;  ++i)
+		c.insert(i, std::string(10, 'a' + i));
+	
+	// records of 4 + 4 + 4 + 10 bytes, 3 to a segment: 0 1 2 | 3
+	std::string v;
+	bool ret = c.size() == 2 && c.disk_size() == 4 && c.segments() == 2;
+	ret = ret && c.find(2, v) && v == std::string(10, 'c') && c.disk_hits() == 1;
+	ret = ret && c.find(2, v) && c.disk_hits() == 1 && c.size() == 2 && c.disk_size() == 4;
+	
+	// 0 1 (2) | 3 4 5 | 2: the first segment is reclaimed
+	c.insert(6, "g");
+	c.insert(7, "h");
+	ret = ret && c.segments() == 2 && !c.find(0, v) && !c.find(1, v) && c.disk_size() == 4;
+	ret = ret && c.find(3, v) && v == std::string(10, 'd') && c.disk_hits() == 2;
+	return test(ret && c.erase(3) && !c.find(3, v) && !c.erase(3));
+}
+
+bool T49()
+{
+	// shared memory: entries inserted by a child process are seen by its parent
+	const std::string name = "lru_tests_" + std::to_string(getpid());
+	bool ret;
+	{
+		SharedLRUCache<int, int> c(name, 3);
+		c.insert(1, 101);
+		
+		pid_t child = fork();
+		if (child == 0) {
+			SharedLRUCache<int, int> other(name, 3);
+			int v = 0;
+			bool ok = other.find(1, v) && v == 101;
+			other.insert(2, 102);
+			other.insert(3, 103);
+			other.insert(4, 104);
+			_exit(ok ? 0 : 1);
+		}
+		int status = -1;
+		waitpid(child, &status, 0);
+		
+		int v = 0;
+		ret = status == 0 && c.size() == 3 && c.find(4, v) && v == 104;
+		ret = ret && c.find(2, v) && v == 102 && !c.contains(1) && c.contains(3);
+	}
+	
+	// a later opening sees the same cache, until removed
+	{
+		SharedLRUCache<int, int> c(name, 3);
+		ret = ret && c.size() == 3 && c.contains(2);
+	}
+	SharedLRUCache<int, int>::remove(name);
+	SharedLRUCache<int, int> c(name, 3);
+	ret = ret && c.empty();
+	SharedLRUCache<int, int>::remove(name);
+	return test(ret);
+}
+
+bool T50()
+{
+	// stats: accesses, insertions, updates and removals by cause
+	LRUCacheH4<int, int> c(2);
+	c.set_clock(test_clock);
+	now = 1000;
+	c.insert(1, 101);
+	c.insert(2, 102);
+	c.insert(2, 112);
+	c.find(1);
+	c.find(3);
+	c[4];
+	c.insert(5, 105, 10);
+	c.erase(4);
+	now = 2000;
+	c.find(5);
+	const LRUCacheH4<int, int> & cc = c;
+	cc.find(1);
+	
+	LRUCacheH4Stats stats = c.stats();
+	bool ret = stats._hits == 1 && stats._misses == 3 && stats._inserts == 4 && stats._updates == 1;
+	ret = ret && stats._evictions == 2 && stats._erasures == 1 && stats._expirations == 1 && stats.hit_ratio() == 0.25;
+	
+	std::ostringstream os;
+	c.dump_stats(os);
+	return test(ret && os.str() == "LRUCacheH4(0/2): hits: 1, misses: 3, hit ratio: 0.25, inserts: 4, "
+		"updates: 1, evictions: 2, erasures: 1, expirations: 1\n");
+}
+
+bool T51()
+{
+	// stats: a sharded cache sums the counters of its shards
+	LRUCacheH4Sharded<int, int> c(100, 4);
+	int v;
+	for (int i = 0;  i < 200;  ++i)
+		c.insert(i, i);
+	for (int i = 0;  i < 200;  ++i)
+		c.find(i, v);
+	LRUCacheH4Stats stats = c.stats();
+	return test(stats._inserts == 200 && stats._evictions == 100 && stats._hits + stats._misses == 200 && stats._hits == size_t(c.size()));
+}
+
+bool T52()
+{
+	// miss ratio curve: exact on a loop over 10 keys when every key is sampled,
+	// and close to the simulated cache on random keys when 1 in 10 is
+	MissRatioCurve<int> loop(1.0, 20, 20);
+	for (int i = 0;  i < 1000;  ++i)
+		loop.access(i % 10);
+	bool ret = loop.samples() == 1000 && loop.sampled_keys() == 10;
+	ret = ret && loop.hit_ratio(9) == 0.0 && loop.hit_ratio(10) == 0.99 && loop.hit_ratio(20) == 0.99;
+	
+	MissRatioCurve<int> mrc(0.1, 4000, 40);
+	LRUCacheH4<int, int> c(1000);
+	srand(171);
+	long hits = 0;
+	for (int i = 0;  i < 200000;  ++i) {
+		const int key = rand() % 5000;
+		mrc.access(key);
+		if (c.find(key) != c.end())
+			++hits;
+		else
+			c.insert(key, key);
+	}
+	const double actual = double(hits) / 200000;
+	ret = ret && mrc.accesses() == 200000 && mrc.samples() < 40000;
+	ret = ret && mrc.hit_ratio(1000) > actual - 0.05 && mrc.hit_ratio(1000) < actual + 0.05;
+	ret = ret && mrc.hit_ratio(500) < mrc.hit_ratio(1000) && mrc.hit_ratio(4000) > 0.75;
+	return test(ret);
+}
+
+bool T53()
+{
+	// set_maxsize(): a shrink evicts in bounded steps on the following lookups
+	LRUCacheH4<int, int> c(1000);
+	for (int i = 0;  i < 1000;  ++i)
+		c.insert(i, i);
+	c.set_maxsize(100);
+	bool ret = c.maxsize() == 100 && c.resizing() && c.size() > 100 && c.size() < 1000;
+	const int before = c.size();
+	c.insert(1000, 1000);
+	ret = ret && c.size() < before;
+	while (c.resizing())
+		c.find(1000);
+	ret = ret && c.size() == 100 && c.weight() == 100 && c.contains(1000) && c.contains(901) && !c.contains(900);
+	ret = ret && c.stats()._evictions == 901;
+	
+	// a grow moves the index to a larger one, lookups finding keys in either
+	LRUCacheH4<int, int> p(1000, true);
+	for (int i = 0;  i < 1000;  ++i)
+		p.insert(i, i);
+	p.set_maxsize(5000);
+	ret = ret && p.resizing() && p.contains(0) && p.contains(999);
+	for (int i = 1000;  i < 5000;  ++i)
+		p.insert(i, i);
+	ret = ret && p.size() == 5000 && !p.resizing();
+	for (int i = 0;  ret && i < 5000;  ++i)
+		ret = p.find(i) != p.end() && p.find(i).value() == i;
+	for (int i = 0;  i < 5000;  i += 2)
+		p.erase(i);
+	ret = ret && p.size() == 2500 && p.lru_begin().key() == 1;
+	
+	p.set_maxsize(10);
+	while (p.resizing())
+		p.find(4999);
+	ret = ret && p.size() == 10 && p.contains(4999) && p.contains(4981) && !p.contains(4979);
+	return test(ret);
+}
+
+bool T54()
+{
+	// set_maxsize() on a sharded cache: each shard gets its share
+	LRUCacheH4Sharded<int, int> c(400, 4);
+	for (int i = 0;  i < 400;  ++i)
+		c.insert(i, i);
+	c.set_maxsize(40);
+	int v;
+	for (int i = 0;  i < 100;  ++i)
+		c.find(i, v);
+	bool ret = c.maxsize() == 40 && c.size() <= 40 + 4;
+	c.set_maxsize(4000);
+	for (int i = 0;  i < 1000;  ++i)
+		c.insert(i, i);
+	ret = ret && c.size() == 1000 && c.shard_maxsize(0) == 1000;
+	return test(ret);
+}
+
+bool T55()
+{
+	// erase_if() and clear() tell the listener, and leave the cache usable
+	LRUCacheH4<int, int> c(1000, true);
+	int erased = 0;
+	c.set_listener([&](const int &, int &, LRUCacheH4Removal cause) { erased += cause == LRU_ERASED; });
+	for (int i = 0;  i < 1000;  ++i)
+		c.insert(i, i * 10);
+	bool ret = c.erase_if([](const int & key, const int &) { return key % 3 == 0; }) == 334;
+	ret = ret && c.size() == 666 && erased == 334 && !c.contains(999) && c.contains(998);
+	ret = ret && c.lru_begin().key() == 1 && c.mru_begin().key() == 998;
+	ret = ret && c.erase_if([](const int &, const int & v) { return v < 0; }) == 0 && c.size() == 666;
+	
+	c.clear();
+	ret = ret && c.size() == 0 && c.weight() == 0 && erased == 1000 && c.stats()._erasures == 1000;
+	ret = ret && !c.contains(1) && c.lru_begin() == c.end();
+	for (int i = 0;  i < 2000;  ++i)
+		c.insert(i, i);
+	ret = ret && c.size() == 1000 && c.contains(1999) && !c.contains(999);
+	return test(ret);
+}
+
+bool T56()
+{
+	// TaggedCache: invalidate() erases the entries of a tag, and the index
+	// follows evictions and replacements
+	TaggedCache<int, int, std::string> c(100);
+	for (int i = 0;  i < 100;  ++i)
+		c.insert(i, i, i % 2 ? "odd" : "even");
+	c.insert(0, 0, TaggedCache<int, int, std::string>::Tags(boost::assign::list_of("even")("zero")));
+	bool ret = c.tag_size("odd") == 50 && c.tag_size("even") == 50 && c.tag_size("zero") == 1;
+	ret = ret && c.invalidate("zero") == 1 && c.tag_size("even") == 49 && c.tags() == 2;
+	
+	ret = ret && c.invalidate("odd") == 50 && c.size() == 49 && c.tag_size("odd") == 0 && c.tags() == 1;
+	int v;
+	ret = ret && !c.find(1, v) && c.find(2, v) && v == 2;
+	
+	c.insert(2, 20, "two");
+	ret = ret && c.tag_size("even") == 48 && c.tag_size("two") == 1;
+	for (int i = 100;  i < 200;  ++i)
+		c.insert(i, i);
+	ret = ret && c.size() == 100 && c.tags() == 0 && c.invalidate("even") == 0;
+	
+	c.insert(1, 1, "odd");
+	c.clear();
+	ret = ret && c.empty() && c.tags() == 0;
+	return test(ret);
+}
+
+// A backing store in memory whose writes fail while fail is set
+struct FailingStore : public BackingStore<int, int>
+{
+	FailingStore() : fail(false) { }
+	
+	virtual void write(const Batch & batch)
+	{
+		if (fail)
+			throw std::runtime_error("store down");
+		for (size_t i = 0;  i < batch.size();  ++i)
+			values[batch[i].first] = batch[i].second;
+	}
+	
+	virtual bool read(const int & key, int & value)
+	{
+		std::map<int, int>::const_iterator it = values.find(key);
+		if (it == values.end())
+			return false;
+		value = it->second;
+		return true;
+	}
+	
+	bool fail;
+	std::map<int, int> values;
+};
+
+bool T57()
+{
+	// write-back: a failed flush loses no value, even for a key both evicted
+	// dirty and dirty again in the cache
+	FailingStore store;
+	store.values[3] = 3;
+	WriteBackCache<int, int> c(1, store);
+	c.insert(1, 1);
+	c.insert(2, 2);
+	c.insert(1, 10);
+	bool ret = c.dirty() == 3;
+	
+	store.fail = true;
+	try {
+		c.flush();
+		ret = false;
+	}
+	catch (const std::runtime_error &) {
+	}
+	ret = ret && c.dirty() == 3;
+	
+	store.fail = false;
+	ret = ret && c.flush() == 3 && c.dirty() == 0 && store.values[1] == 10 && store.values[2] == 2;
+	int v = 0;
+	ret = ret && c.get(3, v) && v == 3 && c.find(3, v) && c.dirty() == 0;
+	return test(ret);
+}
+
+bool T58()
+{
+	// ttl: updating a TTL reuses the pending timer; an entry expires at its
+	// latest deadline, be it later or earlier than the first one
+	LRUCacheH4<int, int> c(10);
+	c.set_clock(test_clock);
+	now = 10000;
+	c.insert(1, 1, 100);
+	c.insert(2, 2, 1000);
+	for (int i = 0;  i < 10000;  ++i)
+		c.insert(1, 1, 100 + i);
+	c.insert(2, 2, 50);
+	now = 10050;
+	bool ret = c.expire() == 1 && c.size() == 1;
+	now = 10100;
+	ret = ret && c.expire() == 0 && c.find(1) != c.end();
+	now = 20098;
+	ret = ret && c.expire() == 0 && c.ttl(1) == 1;
+	now = 20099;
+	ret = ret && c.expire() == 1 && c.size() == 0;
+	
+	// the timers no longer wanted are dropped as their slot cascades
+	LRUCacheH4TimerWheel<int> w(0);
+	for (int i = 0;  i < 1000;  ++i)
+		w.schedule(i, 100000 + i);
+	std::vector<LRUCacheH4TimerWheel<int>::Timer> due;
+	w.advance(100999, due, [](const int & key, uint32_t) { return key % 2 == 0; });
+	return test(ret && due.size() == 500 && due.back().first == 998);
+}
+
+bool T59()
+{
+	// shared memory: a creator that died before initializing the cache times the others out
+	const std::string name = "lru_tests_dead_" + std::to_string(getpid());
+	const std::string path = "/" + name;
+	SharedLRUCache<int, int>::remove(name);
+	int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	bool ret = fd >= 0;
+	
+	// not sized yet
+	try {
+		SharedLRUCache<int, int> c(name, 3, 50);
+		ret = false;
+	}
+	catch (const char *) {
+	}
+	
+	// sized, but no magic number
+	{
+		SharedLRUCache<int, int> sized(name + "_sized", 3);
+		struct stat st;
+		ret = ret && fstat(fd, &st) == 0;
+		{
+			// the size a live cache of the same types has
+			const std::string sized_path = "/" + name + "_sized";
+			int other = shm_open(sized_path.c_str(), O_RDONLY, 0);
+			ret = ret && other >= 0 && fstat(other, &st) == 0 && ftruncate(fd, st.st_size) == 0;
+			close(other);
+		}
+		SharedLRUCache<int, int>::remove(name + "_sized");
+	}
+	try {
+		SharedLRUCache<int, int> c(name, 3, 50);
+		ret = false;
+	}
+	catch (const char *) {
+	}
+	close(fd);
+	
+	// recovered by removing it
+	SharedLRUCache<int, int>::remove(name);
+	SharedLRUCache<int, int> c(name, 3, 50);
+	c.insert(1, 101);
+	ret = ret && c.contains(1);
+	SharedLRUCache<int, int>::remove(name);
+	return test(ret);
+}
+
+bool T60()
+{
+	// tinylfu: insert() is an access, operator[] reaches both segments
+	TinyLFUCache<int, int> c(10);
+	c.insert(1, 101);
+	bool ret = c.frequency(1) == 1;
+	c.insert(1, 102);
+	ret = ret && c.frequency(1) == 2 && c[1] == 102 && c.frequency(1) == 3;
+	c[1] = 103;
+	c.insert(2, 202);                           // pushes 1 into the main segment
+	c[1] += 1;
+	ret = ret && c.find(1).value() == 104 && c[2] == 202 && c.size() == 2;
+	return test(ret && c[3] == 0 && c.size() == 3);
+}
+
+bool T61()
+{
+	// set_maxsize() keeps a given maxweight; a default one follows maxsize
+	typedef LRUCacheH4<int, std::string, StringSize> Cache;
+	Cache c(100, false, 10);
+	c.insert(1, "aaaa");
+	c.insert(2, "bbbb");
+	c.set_maxsize(50);
+	bool ret = c.maxsize() == 50 && c.maxweight() == 10 && c.size() == 2;
+	c.insert(3, "ccc");
+	ret = ret && c.size() == 2 && c.weight() == 7;
+	
+	c.set_maxsize(50, 20);
+	c.insert(4, "dddddddd");
+	ret = ret && c.maxweight() == 20 && c.size() == 3 && c.weight() == 15;
+	c.set_maxsize(200);
+	ret = ret && c.maxweight() == 20;
+	
+	LRUCacheH4<int, int> counted(3);
+	counted.set_maxsize(6);
+	for (int i = 0;  i < 10;  ++i)
+		counted[i] = i;
+	return test(ret && counted.maxweight() == 6 && counted.size() == 6);
+}
+
+bool T62()
+{
+	// an oversize value is reported the same way by insert(), insert_or_assign() and try_emplace():
+	// the value it replaces, and nothing for itself
+	typedef LRUCacheH4<int, std::string, StringSize> Cache;
+	std::vector<std::string> by_insert, by_assign;
+	Cache a(10, false, 10), b(10, false, 10);
+	a.set_listener([&](const int & key, std::string & v, LRUCacheH4Removal cause) {
+		by_insert.push_back(std::to_string(key) + ":" + v + ":" + std::to_string(int(cause)));
+	});
+	b.set_listener([&](const int & key, std::string & v, LRUCacheH4Removal cause) {
+		by_assign.push_back(std::to_string(key) + ":" + v + ":" + std::to_string(int(cause)));
+	});
+	a.insert(1, "a");
+	a.insert(1, std::string(11, 'x'));
+	a.insert(2, std::string(11, 'y'));
+	b.insert(1, "a");
+	bool ret = !b.insert_or_assign(1, std::string(11, 'x')).second;
+	ret = ret && !b.insert_or_assign(2, std::string(11, 'y')).second && !b.try_emplace(3, 11, 'z').second;
+	ret = ret && by_insert == by_assign && by_insert == boost::assign::list_of<std::string>("1:a:2");
+	return test(ret && a.size() == 0 && b.size() == 0 && b.weight() == 0);
+}
+
+bool T63()
+{
+	// clock: the index keeps exactly the keys in the ring as they are recycled
+	ClockCache<int, int> c(50);
+	for (int i = 0;  i < 5000;  ++i) {
+		c.insert(i * 7, i);
+		int v;
+		if (i % 3 == 0)
+			c.find((i / 2) * 7, v);
+	}
+	int found = 0;
+	bool ret = true;
+	for (int i = 0;  i < 5000;  ++i) {
+		int v = -1;
+		if (c.find(i * 7, v)) {
+			++found;
+			ret = ret && v == i;
+		}
+	}
+	return test(ret && found == 50 && c.size() == 50 && c.contains(4999 * 7));
+}
+
+bool T64()
+{
+	// an oversize value on a full cache evicts nothing, whichever way it is inserted
+	typedef LRUCacheH4<int, std::string, StringSize> Cache;
+	Cache a(1, false, 10), b(1, false, 10), c(1, false, 10);
+	int removed = 0;
+	Cache::Listener count = [&](const int &, std::string &, LRUCacheH4Removal) { ++removed; };
+	a.set_listener(count);
+	b.set_listener(count);
+	c.set_listener(count);
+	a.insert(1, "a");
+	b.insert(1, "a");
+	c.insert(1, "a");
+	a.insert(2, std::string(11, 'x'));
+	bool ret = !b.insert_or_assign(2, std::string(11, 'x')).second && !c.try_emplace(2, 11, 'x').second;
+	ret = ret && !b.insert_or_assign(3, "a string too heavy").second;
+	ret = ret && a.contains(1) && b.contains(1) && c.contains(1) && !c.contains(2);
+	return test(ret && removed == 0 && b.size() == 1 && b.weight() == 1);
+}
+
+// A clock that moves on every reading
+uint32_t ticking_clock()
+{
+	return now++;
+}
+
+bool T65()
+{
+	// multi_get: a key repeated in a batch is expired once, whichever read of the
+	// clock sees it expire, and is not a hit for its earlier occurrence
+	bool ret = true;
+	for (unsigned int ttl = 1;  ttl < 8;  ++ttl) {
+		LRUCacheH4<int, int> c(4);
+		c.set_clock(ticking_clock);
+		now = 1000;
+		c.insert(1, 101, ttl);
+		c.insert(2, 102);
+		const int keys[] = { 1, 2, 1, 1 };
+		LRUCacheH4<int, int>::const_iterator found[4];
+		const int hits = c.multi_get(keys, 4, found);
+		int live = 0;
+		for (int i = 0;  i < 4;  ++i)
+			live += found[i] != c.end() && keys[i] == 1;
+		ret = ret && found[1] != c.end() && found[1].value() == 102;
+		ret = ret && (live == 3 || live == 0) && hits == live + 1;
+		ret = ret && c.size() == (live ? 2 : 1) && c.mru_begin().key() == (live ? 1 : 2);
+	}
+	return test(ret);
+}
+
 int main()
 {
 	// TODO: large-scale tests, memory, CPU, complexity
@@ -232,6 +1488,56 @@ int main()
 	T13()->test();
 	T14()->test();
 	T15()->test();
+	T16();
+	T17();
+	T18();
+	T19();
+	T20()->test();
+	T21();
+	T22();
+	T23();
+	T24();
+	T25();
+	T26();
+	T27();
+	T28();
+	T29();
+	T30();
+	T31();
+	T32();
+	T33();
+	T34();
+	T35();
+	T36();
+	T37();
+	T38();
+	T39();
+	T40();
+	T41();
+	T42();
+	T43();
+	T44();
+	T45();
+	T46();
+	T47();
+	T48();
+	T49();
+	T50();
+	T51();
+	T52();
+	T53();
+	T54();
+	T55();
+	T56();
+	T57();
+	T58();
+	T59();
+	T60();
+	T61();
+	T62();
+	T63();
+	T64();
+	T65();
 	
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,187 @@
+/*
+ * Binary key traces, to replay recorded traffic through the caches
+ *
+ * Released as part of lru-cpp-cache:  http://code.google.com/p/lru-cache-cpp/
+ *
+ * Licensed under the GNU LGPL: http://www.gnu.org/copyleft/lesser.html
+ *
+ */
+
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include "trace.hpp"
+
+
+namespace plb {
+
+namespace {
+
+// Header: magic, then the number of records
+const char MAGIC[8] = { 'P', 'L', 'B', 'T', 'R', 'A', 'C', 'E' };
+const size_t HEADER_SIZE = sizeof(MAGIC) + sizeof(uint64_t);
+
+
+bool parse_op(const std::string & word, trace_op & op)
+{
+	if (word == "GET" || word == "get") op = TRACE_GET;
+	else if (word == "SET" || word == "set") op = TRACE_SET;
+	else if (word == "DEL" || word == "del") op = TRACE_DEL;
+	else return false;
+	return true;
+}
+
+
+uint64_t parse_key(const std::string & word)
+{
+	char * end = 0;
+	const uint64_t key = std::strtoull(word.c_str(), &end, 10);
+	if (!word.empty() && *end == '\0')
+		return key;
+	return std::hash<std::string>()(word);
+}
+
+}  // namespace
+
+
+trace_file::trace_file()
+	: _map(0), _length(0), _records(0)
+{
+}
+
+
+trace_file::~trace_file()
+{
+	close();
+}
+
+
+bool trace_file::open(const std::string & path)
+{
+	close();
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (::fstat(fd, &st) != 0 || size_t(st.st_size) < HEADER_SIZE) {
+		::close(fd);
+		return false;
+	}
+
+	// populated up front: the replay should not time page faults
+	void * map = ::mmap(0, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED)
+		return false;
+	::madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	// read() trusts the records: each must end within the file, the last one
+	// exactly at its end, and there must be as many as the header says
+	const char * const first = static_cast<const char *>(map);
+	const char * const last = first + st.st_size;
+	uint64_t records;
+	std::memcpy(&records, first + sizeof(MAGIC), sizeof(records));
+	uint64_t counted = 0;
+	const char * pos = first + HEADER_SIZE;
+	while (pos < last) {
+		const long length = (uint8_t(*pos) & HAS_SIZE) ? 13 : 9;
+		if (last - pos < length)
+			break;
+		pos += length;
+		++counted;
+	}
+	if (std::memcmp(map, MAGIC, sizeof(MAGIC)) != 0 || pos != last || counted != records) {
+		::munmap(map, st.st_size);
+		return false;
+	}
+
+	_map = map;
+	_length = st.st_size;
+	_records = records;
+	return true;
+}
+
+
+void trace_file::close()
+{
+	if (_map)
+		::munmap(_map, _length);
+	_map = 0;
+	_length = 0;
+	_records = 0;
+}
+
+
+long trace_file::records() const
+{
+	return _records;
+}
+
+
+const char * trace_file::begin() const
+{
+	return _map ? static_cast<const char *>(_map) + HEADER_SIZE : 0;
+}
+
+
+const char * trace_file::end() const
+{
+	return _map ? static_cast<const char *>(_map) + _length : 0;
+}
+
+
+long convert_trace(const std::string & text_path, const std::string & trace_path, long * clamped)
+{
+	std::ifstream in(text_path.c_str());
+	std::ofstream out(trace_path.c_str(), std::ios::binary | std::ios::trunc);
+	if (!in || !out)
+		return -1;
+
+	uint64_t records = 0;
+	if (clamped)
+		*clamped = 0;
+	out.write(MAGIC, sizeof(MAGIC));
+	out.write(reinterpret_cast<const char *>(&records), sizeof(records));
+
+	std::string line, word;
+	while (std::getline(in, line)) {
+		std::istringstream is(line);
+		if (!(is >> word))
+			continue;
+
+		trace_op op = TRACE_GET;
+		if (parse_op(word, op) && !(is >> word))
+			continue;
+		const uint64_t key = parse_key(word);
+		unsigned long size = 0;
+		is >> size;
+
+		const uint8_t tag = op | (size ? trace_file::HAS_SIZE : 0);
+		// sizes are recorded on 4 bytes
+		uint32_t size32 = size;
+		if (size > 0xFFFFFFFFUL) {
+			size32 = 0xFFFFFFFF;
+			if (clamped)
+				++*clamped;
+		}
+		out.write(reinterpret_cast<const char *>(&tag), sizeof(tag));
+		out.write(reinterpret_cast<const char *>(&key), sizeof(key));
+		if (size)
+			out.write(reinterpret_cast<const char *>(&size32), sizeof(size32));
+		++records;
+	}
+
+	out.seekp(sizeof(MAGIC));
+	out.write(reinterpret_cast<const char *>(&records), sizeof(records));
+	out.close();
+	return out ? long(records) : -1;
+}
+
+}  // namespace plb
@@ -0,0 +1,86 @@
+/*
+ * Binary key traces, to replay recorded traffic through the caches
+ *
+ * Released as part of lru-cpp-cache:  http://code.google.com/p/lru-cache-cpp/
+ *
+ * A trace is a header followed by records of one byte of op, an 8-byte key
+ * and, if the op says so, a 4-byte size, in host byte order: 9 or 13 bytes
+ * a record. It is read through a read-only mapping, faulted in when opened,
+ * so that reading a record costs a few loads during the replay.
+ *
+ * Licensed under the GNU LGPL: http://www.gnu.org/copyleft/lesser.html
+ *
+ */
+
+#ifndef PLB_TRACE_HPP
+#define PLB_TRACE_HPP
+
+#include <stdint.h>
+#include <cstring>
+#include <string>
+
+
+namespace plb {
+
+enum trace_op {
+	TRACE_GET = 0,
+	TRACE_SET = 1,
+	TRACE_DEL = 2
+};
+
+struct trace_record
+{
+	trace_op op;
+	uint64_t key;
+	uint32_t size;          // 0 if not recorded
+};
+
+
+class trace_file
+{
+public:
+	trace_file();
+	~trace_file();
+
+	bool open(const std::string & path);    // false if missing, not a trace or truncated
+	void close();
+
+	long records() const;                   // as counted in the header
+	const char * begin() const;             // of the records
+	const char * end() const;
+
+	// Reads the record at pos and moves past it. Pre-condition: pos < end()
+	static const char * read(const char * pos, trace_record & record)
+	{
+		const uint8_t op = *pos;
+		std::memcpy(&record.key, pos + 1, sizeof(record.key));
+		record.op = trace_op(op & OP_MASK);
+		if (op & HAS_SIZE) {
+			std::memcpy(&record.size, pos + 9, sizeof(record.size));
+			return pos + 13;
+		}
+		record.size = 0;
+		return pos + 9;
+	}
+
+	enum { OP_MASK = 0x7f, HAS_SIZE = 0x80 };
+
+private:
+	trace_file(const trace_file & other);
+	trace_file & operator=(const trace_file & other);
+
+	void * _map;
+	size_t _length;
+	long _records;
+};
+
+
+// Converts a text log, one access a line: "key", or "op key [size]" with op
+// one of GET, SET and DEL. Keys that are not numbers are hashed, and sizes
+// of 4 GiB or more are clamped to 4 GiB - 1, counted in *clamped. Returns
+// the number of records written, -1 on error.
+long convert_trace(const std::string & text_path, const std::string & trace_path, long * clamped = 0);
+
+}  // namespace plb
+
+#endif  // PLB_TRACE_HPP
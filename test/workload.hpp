@@ -0,0 +1,267 @@
+/*
+ * Synthetic key distributions for the benchmarks
+ *
+ * Released as part of lru-cpp-cache:  http://code.google.com/p/lru-cache-cpp/
+ *
+ * Uniform keys are the one pattern where LRU cannot beat chance: the hit
+ * ratio is cache_size / num_keys whatever the policy. These generators give
+ * the patterns caches are built for, and the ones that defeat them:
+ *  - zipf_keys: a few keys take most accesses, skew tuning how few,
+ *  - scan_keys: a hot set, interrupted by sequential scans of cold keys,
+ *  - drift_keys: a hot set that slides over the key space,
+ *  - loop_keys: the keys in order, over and over.
+ *
+ * Keys are in [0, num_keys). Each generator draws from its own fast_rand:
+ * one generator per thread, seeded, repeats the same keys on every run.
+ *
+ * Licensed under the GNU LGPL: http://www.gnu.org/copyleft/lesser.html
+ *
+ */
+
+#ifndef PLB_WORKLOAD_HPP
+#define PLB_WORKLOAD_HPP
+
+#include <stdint.h>
+#include <cmath>
+#include <sstream>
+#include <string>
+
+
+namespace plb {
+
+// SplitMix64: a few multiplies a number, no shared state
+class fast_rand
+{
+public:
+	fast_rand(uint64_t seed) : _state(seed) { }
+
+	uint64_t next()
+	{
+		uint64_t z = (_state += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		return z ^ (z >> 31);
+	}
+
+	// in [0, n), by multiplication rather than modulo
+	uint32_t below(uint32_t n)
+	{
+		return (uint64_t(uint32_t(next() >> 32)) * n) >> 32;
+	}
+
+	// in [0, 1)
+	double uniform()
+	{
+		return (next() >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+private:
+	uint64_t _state;
+};
+
+
+class key_generator
+{
+public:
+	virtual ~key_generator() { }
+	virtual int next() = 0;
+	virtual std::string name() const = 0;
+};
+
+
+class uniform_keys : public key_generator
+{
+public:
+	uniform_keys(int num_keys, uint64_t seed) : _rand(seed), _num_keys(num_keys) { }
+
+	virtual int next() { return _rand.below(_num_keys); }
+	virtual std::string name() const { return "uniform"; }
+
+private:
+	fast_rand _rand;
+	int _num_keys;
+};
+
+
+// Key k - 1 has a probability proportional to 1 / k^skew, skew > 0. Drawn by
+// rejection-inversion, in constant time and space whatever num_keys.
+// Reference: W. Hormann, G. Derflinger, "Rejection-inversion to generate
+// variates from monotone discrete distributions", ACM TOMACS 6(3), 1996.
+class zipf_keys : public key_generator
+{
+public:
+	zipf_keys(int num_keys, double skew, uint64_t seed)
+		: _rand(seed), _num_keys(num_keys), _skew(skew)
+	{
+		_h_x1 = _h_integral(1.5) - 1.0;
+		_h_n = _h_integral(num_keys + 0.5);
+		_s = 2.0 - _h_integral_inverse(_h_integral(2.5) - _h(2.0));
+	}
+
+	virtual int next()
+	{
+		for (;;) {
+			const double u = _h_n + _rand.uniform() * (_h_x1 - _h_n);
+			const double x = _h_integral_inverse(u);
+			double k = std::floor(x + 0.5);
+			if (k < 1.0)
+				k = 1.0;
+			else if (k > _num_keys)
+				k = _num_keys;
+			if (k - x <= _s || u >= _h_integral(k + 0.5) - _h(k))
+				return int(k) - 1;
+		}
+	}
+
+	virtual std::string name() const
+	{
+		std::ostringstream os;
+		os << "zipf " << _skew;
+		return os.str();
+	}
+
+private:
+	double _h(double x) const
+	{
+		return std::exp(-_skew * std::log(x));
+	}
+
+	// the integral of _h, shifted to be continuous at skew = 1
+	double _h_integral(double x) const
+	{
+		const double log_x = std::log(x);
+		return _expm1_by((1.0 - _skew) * log_x) * log_x;
+	}
+
+	double _h_integral_inverse(double x) const
+	{
+		double t = x * (1.0 - _skew);
+		if (t < -1.0)
+			t = -1.0;
+		return std::exp(_log1p_by(t) * x);
+	}
+
+	// log(1 + x) / x and (exp(x) - 1) / x, with their limits at 0
+	static double _log1p_by(double x)
+	{
+		return std::fabs(x) > 1e-8 ? std::log1p(x) / x : 1.0 - x * (0.5 - x * (1.0 / 3.0 - 0.25 * x));
+	}
+
+	static double _expm1_by(double x)
+	{
+		return std::fabs(x) > 1e-8 ? std::expm1(x) / x : 1.0 + x * 0.5 * (1.0 + x * (1.0 / 3.0) * (1.0 + 0.25 * x));
+	}
+
+private:
+	fast_rand _rand;
+	int _num_keys;
+	double _skew;
+	double _h_x1;
+	double _h_n;
+	double _s;
+};
+
+
+// Uniform over the hot keys [0, hot_keys), except for a fraction of the
+// accesses that continue a sequential scan over the others
+class scan_keys : public key_generator
+{
+public:
+	scan_keys(int num_keys, int hot_keys, double scan_fraction, uint64_t seed)
+		: _rand(seed), _num_keys(num_keys), _hot_keys(hot_keys), _scan_fraction(scan_fraction), _scan(hot_keys)
+	{
+	}
+
+	virtual int next()
+	{
+		if (_hot_keys >= _num_keys || _rand.uniform() >= _scan_fraction)
+			return _rand.below(_hot_keys);
+		const int ret = _scan;
+		if (++_scan == _num_keys)
+			_scan = _hot_keys;
+		return ret;
+	}
+
+	virtual std::string name() const
+	{
+		std::ostringstream os;
+		os << "scan " << _scan_fraction << " of accesses, hot set " << _hot_keys;
+		return os.str();
+	}
+
+private:
+	fast_rand _rand;
+	int _num_keys;
+	int _hot_keys;
+	double _scan_fraction;
+	int _scan;
+};
+
+
+// Hot fraction of the accesses go to a window of hot_keys keys, the others
+// to any key; the window moves up one key every period accesses, wrapping
+class drift_keys : public key_generator
+{
+public:
+	drift_keys(int num_keys, int hot_keys, double hot_fraction, int period, uint64_t seed)
+		: _rand(seed), _num_keys(num_keys), _hot_keys(hot_keys), _hot_fraction(hot_fraction),
+		  _period(period), _count(0), _offset(0)
+	{
+	}
+
+	virtual int next()
+	{
+		if (++_count == _period) {
+			_count = 0;
+			if (++_offset == _num_keys)
+				_offset = 0;
+		}
+		if (_rand.uniform() >= _hot_fraction)
+			return _rand.below(_num_keys);
+		const int key = _offset + _rand.below(_hot_keys);
+		return key < _num_keys ? key : key - _num_keys;
+	}
+
+	virtual std::string name() const
+	{
+		std::ostringstream os;
+		os << "drift " << _hot_fraction << " of accesses to " << _hot_keys << " keys, moving every " << _period;
+		return os.str();
+	}
+
+private:
+	fast_rand _rand;
+	int _num_keys;
+	int _hot_keys;
+	double _hot_fraction;
+	int _period;
+	int _count;
+	int _offset;
+};
+
+
+// 0, 1, ... num_keys - 1, 0, 1, ...: LRU misses every access once the loop
+// is longer than the cache
+class loop_keys : public key_generator
+{
+public:
+	loop_keys(int num_keys) : _num_keys(num_keys), _next(0) { }
+
+	virtual int next()
+	{
+		const int ret = _next;
+		if (++_next == _num_keys)
+			_next = 0;
+		return ret;
+	}
+
+	virtual std::string name() const { return "loop"; }
+
+private:
+	int _num_keys;
+	int _next;
+};
+
+}  // namespace plb
+
+#endif  // PLB_WORKLOAD_HPP